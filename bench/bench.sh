@@ -0,0 +1,121 @@
+#!/bin/sh
+# End-to-end benchmark: build a synthetic libtool project with mlibtool, GNU
+# libtool and nomlibtool.sh, and time full and incremental builds.
+#
+# Use: bench.sh [<dir>]
+#
+# It works in a new directory in <dir> (default $TMPDIR, or /tmp), which is
+# removed afterwards.
+#
+# The project's shape and the build come from the environment:
+#   BENCH_SOURCES      sources per library (default 20)
+#   BENCH_LIBS         shared libraries (default 8)
+#   BENCH_DEPTH        libraries in each chain of dependencies (default 4)
+#   BENCH_CONVENIENCE  convenience libraries (default 2)
+#   BENCH_JOBS         make -j (default 1)
+#   CC, CFLAGS         the compiler (default cc -O1)
+#   MLIBTOOL           the mlibtool to test (default: the one beside bench/)
+#   MLTFLAGS           mlibtool options (default --enable-shared
+#                      --enable-static)
+#   LIBTOOL            GNU libtool (default: libtool in $PATH, or one made
+#                      with autoreconf if there isn't one)
+#
+# The overhead is the time taken by a dry run of every libtool run in the
+# build, divided by their number. Other times are in seconds.
+set -e
+
+BENCH=`dirname "$0"`
+BENCH=`cd "$BENCH" && pwd`
+TOP=`dirname "$BENCH"`
+SOURCES=${BENCH_SOURCES:-20}
+LIBS=${BENCH_LIBS:-8}
+DEPTH=${BENCH_DEPTH:-4}
+CONVENIENCE=${BENCH_CONVENIENCE:-2}
+JOBS=${BENCH_JOBS:-1}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O1}
+MLIBTOOL=${MLIBTOOL:-$TOP/mlibtool}
+MLTFLAGS=${MLTFLAGS:---enable-shared --enable-static}
+PARENT=${1:-${TMPDIR:-/tmp}}
+WORK=$PARENT/mlibtool-bench.$$
+
+if [ ! -x "$MLIBTOOL" ]; then
+    echo "bench.sh: $MLIBTOOL isn't built" >&2
+    exit 1
+fi
+mkdir -p "$PARENT"
+mkdir "$WORK"
+WORK=`cd "$WORK" && pwd`
+
+# run a command (its output going to $WORK/log), and print its wall time
+if command -v time > /dev/null 2>&1; then
+    timed() {
+        { time -p sh -c 'exec "$@" > "$0" 2>&1' "$WORK/log" "$@"; } 2> "$WORK/time" ||
+            { cat "$WORK/log" >&2; exit 1; }
+        sed -n 's/^real *//p' "$WORK/time"
+    }
+else
+    # no time(1), but GNU date can do
+    timed() {
+        start=`date +%s.%N`
+        "$@" > "$WORK/log" 2>&1 || { cat "$WORK/log" >&2; exit 1; }
+        end=`date +%s.%N`
+        echo "$start $end" | awk '{ printf "%.2f\n", $2 - $1 }'
+    }
+fi
+
+# find or make GNU libtool
+if [ -z "$LIBTOOL" ]; then
+    LIBTOOL=`command -v libtool || true`
+fi
+if [ -z "$LIBTOOL" ] && command -v autoreconf > /dev/null 2>&1; then
+    mkdir "$WORK/gnu-libtool"
+    printf 'AC_INIT([bench], [1])\nAC_PROG_CC\nLT_INIT\nAC_OUTPUT\n' > "$WORK/gnu-libtool/configure.ac"
+    if ( cd "$WORK/gnu-libtool" && autoreconf -i && ./configure CC="$CC" ) > "$WORK/log" 2>&1; then
+        LIBTOOL="$WORK/gnu-libtool/libtool"
+    fi
+fi
+if [ -z "$LIBTOOL" ]; then
+    echo "bench.sh: no GNU libtool, so only benchmarking mlibtool" >&2
+fi
+
+sh "$BENCH/genproject.sh" "$WORK/project" "$SOURCES" "$LIBS" "$DEPTH" "$CONVENIENCE"
+RUNS=`grep -c '^	$(LT' "$WORK/project/Makefile"`
+
+echo "project: $SOURCES sources in each of $LIBS libraries (chains of $DEPTH)" \
+     "and $CONVENIENCE convenience libraries, $RUNS libtool runs, make -j$JOBS"
+printf '%-12s %10s %12s %14s\n' tool full incremental 'overhead/run'
+
+# benchmark one way of running libtool
+bench() {
+    name="$1"
+    shift
+    rm -rf "$WORK/$name"
+    cp -R "$WORK/project" "$WORK/$name"
+    cd "$WORK/$name"
+
+    full=`timed make -j"$JOBS" CC="$CC" CFLAGS="$CFLAGS" LIBTOOL="$*"`
+    ./prog > /dev/null
+
+    # one source at the bottom of the first chain
+    sleep 1
+    touch l0/s0.c
+    incremental=`timed make -j"$JOBS" CC="$CC" CFLAGS="$CFLAGS" LIBTOOL="$*"`
+
+    # every run again, but doing nothing
+    sleep 1
+    touch common.h
+    dry=`timed make -j1 CC="$CC" CFLAGS="$CFLAGS" LIBTOOL="$* --dry-run"`
+    overhead=`echo "$dry $RUNS" | awk '{ printf "%.2fms", $1 * 1000 / $2 }'`
+
+    cd "$WORK"
+    printf '%-12s %10s %12s %14s\n' "$name" "$full" "$incremental" "$overhead"
+}
+
+bench mlibtool "$MLIBTOOL" $MLTFLAGS "${LIBTOOL:-false}"
+if [ -n "$LIBTOOL" ]; then
+    bench libtool "$LIBTOOL"
+    bench nomlibtool sh "$TOP/nomlibtool.sh" $MLTFLAGS "$LIBTOOL"
+fi
+
+rm -rf "$WORK"
@@ -0,0 +1,139 @@
+#!/bin/sh
+# Generate a synthetic libtool project, for benchmarking.
+#
+# Use: genproject.sh <dir> <sources> <libs> <depth> <convenience>
+#
+# The project has <libs> shared libraries of <sources> sources each, in chains
+# of <depth> libraries where each depends on the one before it, and
+# <convenience> convenience libraries of <sources> sources each, linked into
+# the shared libraries in turn. A program uses the last library of each
+# chain. Its Makefile builds everything with $(LIBTOOL), $(CC) and $(CFLAGS).
+set -e
+
+usage() {
+    echo 'Use: genproject.sh <dir> <sources> <libs> <depth> <convenience>' >&2
+    exit 1
+}
+
+[ $# -eq 5 ] || usage
+DIR="$1"
+SOURCES="$2"
+LIBS="$3"
+DEPTH="$4"
+CONVENIENCE="$5"
+[ "$SOURCES" -gt 0 ] 2> /dev/null || usage
+[ "$LIBS" -gt 0 ] 2> /dev/null || usage
+[ "$DEPTH" -gt 0 ] 2> /dev/null || usage
+[ "$CONVENIENCE" -ge 0 ] 2> /dev/null || usage
+
+mkdir -p "$DIR"
+cd "$DIR"
+
+# write a library's sources, each calling the one before it, and the first
+# calling <call> (if given); and its objects' rules
+genLib() {
+    lib="$1"
+    call="$2"
+    mkdir -p "$lib"
+    prev="$call"
+    s=0
+    while [ "$s" -lt "$SOURCES" ]; do
+        {
+            echo '#include "../common.h"'
+            [ -n "$prev" ] && echo "int $prev(int);"
+            echo "int ${lib}_s$s(int x)"
+            echo '{'
+            echo '    int i, y = x;'
+            echo '    for (i = 0; i < BENCH_ROUNDS; i++)'
+            echo "        y = y * 31 + i + $s;"
+            [ -n "$prev" ] && echo "    y += $prev(x);"
+            echo '    return y;'
+            echo '}'
+        } > "$lib/s$s.c"
+        printf '%s/s%d.lo: %s/s%d.c common.h\n' "$lib" "$s" "$lib" "$s" >> Makefile
+        printf '\t$(LTCOMPILE) -c %s/s%d.c -o %s/s%d.lo\n' "$lib" "$s" "$lib" "$s" >> Makefile
+        prev="${lib}_s$s"
+        s=$((s + 1))
+    done
+}
+
+# the objects of a library
+libObjects() {
+    s=0
+    while [ "$s" -lt "$SOURCES" ]; do
+        printf ' %s/s%d.lo' "$1" "$s"
+        s=$((s + 1))
+    done
+}
+
+echo '#define BENCH_ROUNDS 16' > common.h
+
+cat > Makefile <<'X'
+CC = cc
+CFLAGS = -O1
+LIBTOOL = libtool
+LTCOMPILE = $(LIBTOOL) --tag=CC --mode=compile $(CC) $(CFLAGS)
+LTLINK = $(LIBTOOL) --tag=CC --mode=link $(CC) $(CFLAGS)
+
+all: prog
+
+X
+
+c=0
+while [ "$c" -lt "$CONVENIENCE" ]; do
+    genLib "c$c" ""
+    printf 'c%d/libc%d.la:%s\n' "$c" "$c" "`libObjects c$c`" >> Makefile
+    printf '\t$(LTLINK) -o $@%s\n\n' "`libObjects c$c`" >> Makefile
+    c=$((c + 1))
+done
+
+TOPS=
+CALLS=
+l=0
+while [ "$l" -lt "$LIBS" ]; do
+    deps=
+    call=
+    if [ $((l % DEPTH)) -ne 0 ]; then
+        deps=" l$((l - 1))/libl$((l - 1)).la"
+        call="l$((l - 1))_s$((SOURCES - 1))"
+    fi
+    c=$l
+    while [ "$c" -lt "$CONVENIENCE" ]; do
+        deps="$deps c$c/libc$c.la"
+        c=$((c + LIBS))
+    done
+    genLib "l$l" "$call"
+    printf 'l%d/libl%d.la:%s%s\n' "$l" "$l" "`libObjects l$l`" "$deps" >> Makefile
+    printf '\t$(LTLINK) -rpath /usr/local/lib -o $@%s%s\n\n' "`libObjects l$l`" "$deps" >> Makefile
+
+    # the program uses the last of each chain
+    if [ $(((l + 1) % DEPTH)) -eq 0 ] || [ "$l" -eq $((LIBS - 1)) ]; then
+        TOPS="$TOPS l$l/libl$l.la"
+        CALLS="$CALLS l${l}_s$((SOURCES - 1))"
+    fi
+    l=$((l + 1))
+done
+
+{
+    echo '#include <stdio.h>'
+    echo '#include "common.h"'
+    for f in $CALLS; do echo "int $f(int);"; done
+    echo 'int main(void)'
+    echo '{'
+    echo '    int y = 0;'
+    for f in $CALLS; do echo "    y += $f(1);"; done
+    printf '    printf("%%d\\n", y);\n'
+    echo '    return 0;'
+    echo '}'
+} > prog.c
+
+cat >> Makefile <<X
+prog.lo: prog.c common.h
+	\$(LTCOMPILE) -c prog.c -o prog.lo
+
+prog: prog.lo$TOPS
+	\$(LTLINK) -o prog prog.lo$TOPS
+
+clean:
+	rm -rf prog prog.lo prog.o .libs */*.lo */*.o */*.la */.libs .mlibtool-*
+X
@@ -0,0 +1,318 @@
+/*
+ * microbench: time mlibtool's own work, with a compiler that does nothing
+ *
+ * Use: microbench <mlibtool> <stubcc> [runs]
+ *
+ * Each benchmark runs mlibtool <runs> times (default 100) in a scratch
+ * directory, with stubcc as the compiler and --dry-run where that helps, and
+ * prints one line:
+ *  <name> <median microseconds> <minimum microseconds> <runs>
+ *
+ * baseline is the cost of running a program at all (stubcc), for comparison
+ * with startup, which is mlibtool doing next to nothing.
+ */
+#define _XOPEN_SOURCE 600
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define LO_INPUTS 10000
+#define CHAIN_DEPTH 256
+#define DENSE_LIBS 64
+
+/* a command being built. Its arguments are all allocated. */
+struct Cmd {
+    char **argv;
+    size_t used, sz;
+};
+
+static char *mlibtool, *stubcc;
+static int runs = 100;
+
+static void *orDie(void *ptr)
+{
+    if (!ptr) {
+        perror("microbench");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void cmdAdd(struct Cmd *cmd, const char *arg)
+{
+    if (cmd->used + 2 > cmd->sz) {
+        cmd->sz = cmd->sz ? cmd->sz * 2 : 32;
+        cmd->argv = orDie(realloc(cmd->argv, cmd->sz * sizeof(char *)));
+    }
+    cmd->argv[cmd->used++] = orDie(strdup(arg));
+    cmd->argv[cmd->used] = NULL;
+}
+
+/* add a numbered argument, e.g. f%d.lo */
+static void cmdAddf(struct Cmd *cmd, const char *fmt, int num)
+{
+    char buf[256];
+    sprintf(buf, fmt, num);
+    cmdAdd(cmd, buf);
+}
+
+/* start a command with mlibtool and its mlibtool options */
+static void cmdInit(struct Cmd *cmd, const char *mltOptions)
+{
+    memset(cmd, 0, sizeof(*cmd));
+    cmdAdd(cmd, mlibtool);
+    if (mltOptions) cmdAdd(cmd, mltOptions);
+    cmdAdd(cmd, "false");
+}
+
+static void cmdFree(struct Cmd *cmd)
+{
+    size_t i;
+    for (i = 0; i < cmd->used; i++)
+        free(cmd->argv[i]);
+    free(cmd->argv);
+}
+
+/* Run a command with its output thrown away. Returns its wall time in
+ * microseconds, or -1 if it failed. */
+static double run(char **argv)
+{
+    struct timeval start, end;
+    pid_t pid;
+    int status, fd;
+
+    gettimeofday(&start, NULL);
+    pid = fork();
+    if (pid == 0) {
+        if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (pid == -1 || waitpid(pid, &status, 0) != pid || status != 0)
+        return -1;
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec);
+}
+
+/* run a command to set up a benchmark */
+static void setup(struct Cmd *cmd)
+{
+    if (run(cmd->argv) < 0) {
+        fprintf(stderr, "microbench: failed to run %s ... %s\n",
+                cmd->argv[0], cmd->argv[cmd->used-1]);
+        exit(1);
+    }
+    cmdFree(cmd);
+}
+
+static int compareTimes(const void *a, const void *b)
+{
+    double at = *(const double *) a, bt = *(const double *) b;
+    return (at < bt) ? -1 : (at > bt) ? 1 : 0;
+}
+
+/* Time a command, and free it. If cold is set, the sanity cache is removed
+ * before each run. */
+static void bench(const char *name, struct Cmd *cmd, int cold)
+{
+    double *times = orDie(malloc(runs * sizeof(double)));
+    int i;
+
+    for (i = 0; i < runs; i++) {
+        if (cold) unlink(".mlibtool-sanity");
+        if ((times[i] = run(cmd->argv)) < 0) {
+            fprintf(stderr, "microbench: %s failed\n", name);
+            exit(1);
+        }
+    }
+    qsort(times, runs, sizeof(double), compareTimes);
+    printf("%s %.0f %.0f %d\n", name, times[runs / 2], times[0], runs);
+    fflush(stdout);
+
+    free(times);
+    cmdFree(cmd);
+}
+
+/* copy the .lo file every input is made from */
+static void copyLo(const char *to)
+{
+    static char buf[4096];
+    static size_t len = 0;
+    FILE *f;
+
+    if (!len) {
+        f = orDie(fopen("x.lo", "r"));
+        len = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+    }
+    f = orDie(fopen(to, "w"));
+    if (fwrite(buf, 1, len, f) != len || fclose(f) != 0) {
+        perror(to);
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct Cmd cmd;
+    char work[256], name[64];
+    const char *tmp;
+    FILE *f;
+    int i, j;
+
+    if (argc < 3) {
+        fprintf(stderr, "Use: microbench <mlibtool> <stubcc> [runs]\n");
+        return 1;
+    }
+    mlibtool = orDie(realpath(argv[1], NULL));
+    stubcc = orDie(realpath(argv[2], NULL));
+    if (argc > 3) runs = atoi(argv[3]);
+    if (runs < 1) runs = 1;
+
+    if (!(tmp = getenv("TMPDIR")) || strlen(tmp) > 128) tmp = "/tmp";
+    sprintf(work, "%s/mlibtool-micro.%ld", tmp, (long) getpid());
+    if (mkdir(work, 0777) != 0 || chdir(work) != 0) {
+        perror(work);
+        return 1;
+    }
+    f = orDie(fopen("x.c", "w"));
+    fprintf(f, "int x(void) { return 0; }\n");
+    fclose(f);
+
+    printf("# benchmark median_us min_us runs\n");
+
+    /* running anything */
+    memset(&cmd, 0, sizeof(cmd));
+    cmdAdd(&cmd, stubcc);
+    bench("baseline", &cmd, 0);
+
+    /* mlibtool doing next to nothing */
+    cmdInit(&cmd, NULL);
+    cmdAdd(&cmd, "--version");
+    bench("startup", &cmd, 0);
+
+    /* scanning its own options and libtool's */
+    memset(&cmd, 0, sizeof(cmd));
+    cmdAdd(&cmd, mlibtool);
+    for (i = 0; i < 500; i++)
+        cmdAdd(&cmd, "--enable-shared");
+    cmdAdd(&cmd, "false");
+    for (i = 0; i < 500; i++)
+        cmdAdd(&cmd, "--tag=CC");
+    cmdAdd(&cmd, "--version");
+    bench("args_1000", &cmd, 0);
+
+    /* the sanity check, probing the compiler or from the cache */
+    for (i = 0; i < 2; i++) {
+        cmdInit(&cmd, NULL);
+        cmdAdd(&cmd, "--dry-run");
+        cmdAdd(&cmd, "--mode=compile");
+        cmdAdd(&cmd, stubcc);
+        cmdAdd(&cmd, "-c");
+        cmdAdd(&cmd, "x.c");
+        bench(i ? "sanity_warm" : "sanity_cold", &cmd, !i);
+    }
+
+    /* one .lo, copied for every input */
+    cmdInit(&cmd, "--enable-shared");
+    cmdAdd(&cmd, "--mode=compile");
+    cmdAdd(&cmd, stubcc);
+    cmdAdd(&cmd, "-c");
+    cmdAdd(&cmd, "x.c");
+    cmdAdd(&cmd, "-o");
+    cmdAdd(&cmd, "x.lo");
+    setup(&cmd);
+
+    /* a link of a great many objects */
+    cmdInit(&cmd, "--enable-shared");
+    cmdAdd(&cmd, "--dry-run");
+    cmdAdd(&cmd, "--mode=link");
+    cmdAdd(&cmd, stubcc);
+    cmdAdd(&cmd, "-rpath");
+    cmdAdd(&cmd, "/usr/lib");
+    cmdAdd(&cmd, "-o");
+    cmdAdd(&cmd, "libbig.la");
+    for (i = 0; i < LO_INPUTS; i++) {
+        sprintf(name, "f%d.lo", i);
+        copyLo(name);
+        cmdAdd(&cmd, name);
+    }
+    sprintf(name, "link_%d_lo", LO_INPUTS);
+    bench(name, &cmd, 0);
+
+    /* a program linked to the end of a long chain of libraries, each
+     * depending on the one before */
+    for (i = 0; i < CHAIN_DEPTH; i++) {
+        cmdInit(&cmd, "--enable-shared");
+        cmdAdd(&cmd, "--mode=link");
+        cmdAdd(&cmd, stubcc);
+        cmdAdd(&cmd, "-rpath");
+        cmdAdd(&cmd, "/usr/lib");
+        cmdAdd(&cmd, "-o");
+        cmdAddf(&cmd, "libchain%d.la", i);
+        cmdAdd(&cmd, "x.lo");
+        if (i) cmdAddf(&cmd, "libchain%d.la", i - 1);
+        setup(&cmd);
+    }
+    cmdInit(&cmd, "--enable-shared");
+    cmdAdd(&cmd, "--dry-run");
+    cmdAdd(&cmd, "--mode=link");
+    cmdAdd(&cmd, stubcc);
+    cmdAdd(&cmd, "-o");
+    cmdAdd(&cmd, "prog");
+    cmdAdd(&cmd, "x.lo");
+    cmdAddf(&cmd, "libchain%d.la", CHAIN_DEPTH - 1);
+    sprintf(name, "la_chain_%d", CHAIN_DEPTH);
+    bench(name, &cmd, 0);
+
+    /* and to every one of a set of libraries each depending on all those
+     * before it */
+    for (i = 0; i < DENSE_LIBS; i++) {
+        cmdInit(&cmd, "--enable-shared");
+        cmdAdd(&cmd, "--mode=link");
+        cmdAdd(&cmd, stubcc);
+        cmdAdd(&cmd, "-rpath");
+        cmdAdd(&cmd, "/usr/lib");
+        cmdAdd(&cmd, "-o");
+        cmdAddf(&cmd, "libdense%d.la", i);
+        cmdAdd(&cmd, "x.lo");
+        for (j = 0; j < i; j++)
+            cmdAddf(&cmd, "libdense%d.la", j);
+        setup(&cmd);
+    }
+    cmdInit(&cmd, "--enable-shared");
+    cmdAdd(&cmd, "--dry-run");
+    cmdAdd(&cmd, "--mode=link");
+    cmdAdd(&cmd, stubcc);
+    cmdAdd(&cmd, "-o");
+    cmdAdd(&cmd, "prog");
+    cmdAdd(&cmd, "x.lo");
+    for (j = 0; j < DENSE_LIBS; j++)
+        cmdAddf(&cmd, "libdense%d.la", j);
+    sprintf(name, "la_dense_%d", DENSE_LIBS);
+    bench(name, &cmd, 0);
+
+    /* clean up */
+    if (chdir("..") == 0) {
+        memset(&cmd, 0, sizeof(cmd));
+        cmdAdd(&cmd, "/bin/rm");
+        cmdAdd(&cmd, "-rf");
+        cmdAdd(&cmd, work);
+        run(cmd.argv);
+        cmdFree(&cmd);
+    }
+
+    free(mlibtool);
+    free(stubcc);
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * stubcc: a compiler that does nothing, so that benchmarks can time only
+ * what's around it. It leaves its output (-o) empty, and when preprocessing
+ * with no output, it says the target is sane, for mlibtool's sanity check.
+ */
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char **argv)
+{
+    const char *out = NULL;
+    int i, preprocess = 0, fromStdin = 0;
+    FILE *f;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            out = argv[++i];
+        else if (!strcmp(argv[i], "-E"))
+            preprocess = 1;
+        else if (!strcmp(argv[i], "-"))
+            fromStdin = 1;
+    }
+
+    /* don't leave whoever is writing to us with a broken pipe */
+    if (fromStdin)
+        while (getchar() != EOF);
+
+    if (out) {
+        if (!(f = fopen(out, "w"))) {
+            perror(out);
+            return 1;
+        }
+        fclose(f);
+    } else if (preprocess) {
+        printf("SYSTEM_IS_SANE\n");
+    }
+    return 0;
+}
@@ -31,7 +31,11 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
+#ifdef __linux__
+/* for syscall and wait4 */
+#define _DEFAULT_SOURCE 1
+#endif
 
 /* headers used in written .l* files */
 #define SANE_HEADER "# SYSTEM_IS_SANE\n"
@@ -49,6 +53,10 @@
                  /* SVR4 and derivatives (e.g. Solaris) which are not HP-UX */ \
              ")"
 
+/* facts we learn about the target by asking the preprocessor */
+#define SANITY_SANE 1 /* the target is sane */
+#define SANITY_PIE  2 /* the compiler builds PIE by default */
+
 /* our binary runner script */
 #define BIN_SCRIPT_1 "#!/bin/sh\n" \
                      PACKAGE_HEADER \
@@ -95,13 +103,42 @@ int main(int argc, char **argv)
 }
 #else
 
+#include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <utime.h>
+
+#if defined(_POSIX_SPAWN) && _POSIX_SPAWN > 0
+#define USE_POSIX_SPAWN 1
+#include <spawn.h>
+extern char **environ;
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+
+/* the nanoseconds of a file's mtime, where stat gives them */
+#if defined(__linux__)
+#define MTIME_NSEC(sbuf) ((long) (sbuf).st_mtim.tv_nsec)
+#elif defined(__APPLE__)
+#define MTIME_NSEC(sbuf) ((long) (sbuf).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(sbuf) 0L
+#endif
 
 /* a simple buffer type for our persistent char ** commands */
 struct Buffer {
@@ -131,91 +168,418 @@ struct Buffer {
     free((ubuf).buf); \
 } while (0)
 
+/* a 128-bit FNV-1a hash, for recognizing file contents and commands */
+struct Hash {
+    uint64_t hi, lo;
+};
+
+/* hex digest size, including the terminator */
+#define HASH_HEX_SZ 33
 
-/* Generate a filename to cache sanity (allocates) */
-static char *cachedSanityName(char *cc, char **argv)
+static void hashInit(struct Hash *hash)
 {
-    int i;
-    char *repr = NULL;
-    char *dirC, *dir, *ret;
+    hash->hi = 0x6c62272e07bb0142ULL;
+    hash->lo = 0x62b821756295c58dULL;
+}
 
-    for (i = 0; argv[i]; i++) {
-        char *ext;
-        if (!strcmp(argv[i], "-o") && argv[i+1]) {
-            repr = argv[i+1];
-            break;
+static void hashUpdate(struct Hash *hash, const void *data, size_t len)
+{
+    const unsigned char *cdata = (const unsigned char *) data;
+    uint64_t hi = hash->hi, lo = hash->lo, p0, p1;
+    size_t i;
 
-        } else if ((ext = strrchr(argv[i], '.'))) {
-            if (ext[1] == 'l' && (ext[2] == 'a' || ext[2] == 'o')) {
-                repr = argv[i];
-                break;
-            }
+    for (i = 0; i < len; i++) {
+        lo ^= cdata[i];
+
+        /* multiply by the prime, 2^88 + 0x13b */
+        p0 = (lo & 0xffffffffULL) * 0x13b;
+        p1 = (lo >> 32) * 0x13b;
+        hi = hi * 0x13b + ((p1 + (p0 >> 32)) >> 32) + (lo << 24);
+        lo *= 0x13b;
+    }
+
+    hash->hi = hi;
+    hash->lo = lo;
+}
+
+/* hash a string, including its terminator */
+static void hashString(struct Hash *hash, const char *str)
+{
+    hashUpdate(hash, str, strlen(str) + 1);
+}
+
+/* hash a file's contents. Returns -1 if it can't be read. */
+static int hashFile(struct Hash *hash, const char *name)
+{
+    char buf[BUFSIZ];
+    ssize_t rd;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return -1;
+    while ((rd = read(fd, buf, BUFSIZ)) > 0)
+        hashUpdate(hash, buf, rd);
+    close(fd);
+    return (rd < 0) ? -1 : 0;
+}
+
+static void hashHex(struct Hash *hash, char *hex)
+{
+    sprintf(hex, "%08lx%08lx%08lx%08lx",
+            (unsigned long) (hash->hi >> 32),
+            (unsigned long) (hash->hi & 0xffffffffUL),
+            (unsigned long) (hash->lo >> 32),
+            (unsigned long) (hash->lo & 0xffffffffUL));
+}
+
+/* Find a program in $PATH, as execvp would (allocates) */
+static char *findProgram(const char *name)
+{
+    char *path, *pathC, *part, *saveptr, *full;
+
+    if (strchr(name, '/') || !(path = getenv("PATH")))
+        return strdup(name);
+
+    if (!(pathC = strdup(path))) return NULL;
+    for (part = strtok_r(pathC, ":", &saveptr); part;
+         part = strtok_r(NULL, ":", &saveptr)) {
+        if (!(full = malloc(strlen(part) + strlen(name) + 2))) break;
+        sprintf(full, "%s/%s", part, name);
+        if (access(full, X_OK) == 0) {
+            free(pathC);
+            return full;
         }
+        free(full);
     }
+    free(pathC);
+    return strdup(name);
+}
 
-    if (repr == NULL) {
-        /* nothing to use! */
-        return NULL;
+/* Hash the identity of a program, by the name it's run by, where it really is
+ * and when it was changed. The name matters for wrappers like ccache and
+ * distcc, which are linked to as gcc, clang and so on, and act as whichever
+ * they're run as. Returns -1 if it can't be found. */
+static int hashProgram(struct Hash *hash, const char *name)
+{
+    char *full, *real;
+    struct stat sbuf;
+    char buf[64];
+    int ret = -1;
+
+    if (!(full = findProgram(name))) return -1;
+    if ((real = realpath(full, NULL))) {
+        if (stat(real, &sbuf) == 0) {
+            hashString(hash, full);
+            hashString(hash, real);
+            sprintf(buf, "%lu %ld", (unsigned long) sbuf.st_size,
+                    (long) sbuf.st_mtime);
+            hashString(hash, buf);
+            ret = 0;
+        }
+        free(real);
     }
+    free(full);
+    return ret;
+}
 
-    /* get its directory name */
-    ORX(dirC, strdup, NULL, (repr));
-    dir = dirname(dirC);
+/* Copy a file to a new file as a reflink, sharing its data. Returns -1 if the
+ * system or filesystem can't. */
+static int reflinkFile(const char *from, const char *to, mode_t mode)
+{
+#ifdef FICLONE
+    int ifd, ofd, ret;
 
-    /* and make the cache name */
-    ORX(ret, malloc, NULL, (strlen(dir) + strlen(cc) + 13));
-    sprintf(ret, "%s/.libs", dir);
-    mkdir(ret, 0777);
-    sprintf(ret, "%s/.libs/sane.%s", dir, cc);
-    free(dirC);
+    if ((ifd = open(from, O_RDONLY)) < 0) return -1;
+    if ((ofd = open(to, O_WRONLY|O_CREAT|O_TRUNC, mode)) < 0) {
+        close(ifd);
+        return -1;
+    }
+    ret = ioctl(ofd, FICLONE, ifd);
+    close(ifd);
+    if (close(ofd) != 0) ret = -1;
+    if (ret != 0) unlink(to);
     return ret;
+#else
+    return -1;
+#endif
 }
 
-/* Cache the sanity of this system if possible */
-static void systemCacheSanity(char *cc, char **argv, int sane)
+/* Copy a file to a new file, with a reflink if the system supports it, or
+ * else in the kernel if it can. Returns -1 on failure. */
+static int copyFile(const char *from, const char *to, mode_t mode)
 {
-    FILE *f;
-    char *cacheName = cachedSanityName(cc, argv);
-    if (!cacheName) return;
-    if (access(cacheName, F_OK) == 0) {
-        free(cacheName);
-        return;
+    char buf[BUFSIZ];
+    ssize_t rd;
+    int ifd, ofd, ret = 0;
+
+    if (reflinkFile(from, to, mode) == 0) return 0;
+
+    if ((ifd = open(from, O_RDONLY)) < 0) return -1;
+    if ((ofd = open(to, O_WRONLY|O_CREAT|O_TRUNC, mode)) < 0) {
+        close(ifd);
+        return -1;
     }
-    f = fopen(cacheName, "w");
-    if (f) {
-        fwrite(sane ? "1" : "0", 1, 1, f);
-        fclose(f);
+
+#ifdef SYS_copy_file_range
+    /* this moves both offsets along, so if it stops early for any reason,
+     * the rest is just read and written */
+    while (syscall(SYS_copy_file_range, ifd, NULL, ofd, NULL,
+                   (size_t) 1 << 30, 0) > 0) {
+        /* copied some */
+    }
+#endif
+
+    while ((rd = read(ifd, buf, BUFSIZ)) > 0) {
+        if (write(ofd, buf, rd) != rd) {
+            ret = -1;
+            break;
+        }
+    }
+    if (rd < 0) ret = -1;
+    close(ifd);
+    if (close(ofd) != 0) ret = -1;
+    if (ret != 0) unlink(to);
+    return ret;
+}
+
+/* Do these two files have the same contents? */
+static int sameContents(const char *a, const char *b)
+{
+    char abuf[BUFSIZ], bbuf[BUFSIZ];
+    struct stat asbuf, bsbuf;
+    ssize_t ard, brd;
+    int afd, bfd, same = 1;
+
+    if (stat(a, &asbuf) != 0 || stat(b, &bsbuf) != 0 ||
+        asbuf.st_size != bsbuf.st_size)
+        return 0;
+
+    if ((afd = open(a, O_RDONLY)) < 0) return 0;
+    if ((bfd = open(b, O_RDONLY)) < 0) {
+        close(afd);
+        return 0;
     }
-    free(cacheName);
+
+    while (same && (ard = read(afd, abuf, BUFSIZ)) > 0) {
+        /* regular files give us full reads until the end */
+        brd = read(bfd, bbuf, ard);
+        if (brd != ard || memcmp(abuf, bbuf, ard))
+            same = 0;
+    }
+    if (ard < 0) same = 0;
+
+    close(afd);
+    close(bfd);
+    return same;
+}
+
+
+/* Get the current directory (allocates) */
+static char *currentDir(void)
+{
+    size_t sz = 256;
+    char *buf = NULL;
+
+    while (1) {
+        char *nbuf = realloc(buf, sz);
+        if (!nbuf) break;
+        buf = nbuf;
+        if (getcwd(buf, sz)) return buf;
+        if (errno != ERANGE) break;
+        sz *= 2;
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Find the top of the build tree, the nearest directory up from here with a
+ * config.status, or here if there is none (allocates) */
+static char *buildTreeRoot(void)
+{
+    char *dir, *path, *slash;
+
+    if (!(dir = currentDir())) return NULL;
+    ORX(path, malloc, NULL, (strlen(dir) + 15));
+    while (1) {
+        sprintf(path, "%s/config.status", dir);
+        if (access(path, F_OK) == 0) {
+            free(path);
+            return dir;
+        }
+        if (!(slash = strrchr(dir, '/')) || slash == dir) break;
+        *slash = '\0';
+    }
+    free(path);
+    free(dir);
+    return currentDir();
+}
+
+/* Does this argument change the target, and so what the preprocessor tells us
+ * about it? Returns how many arguments it takes up (0 if it doesn't). */
+static int targetFlag(char **argv, int i)
+{
+    char *arg = argv[i];
+    if (arg[0] != '-') return 0;
+
+    if ((!strcmp(arg, "-target") || !strcmp(arg, "--sysroot") ||
+         !strcmp(arg, "-isysroot")) && argv[i+1])
+        return 2;
+
+    if (arg[1] == 'm' ||
+        !strncmp(arg, "--target=", 9) ||
+        !strncmp(arg, "--sysroot=", 10) ||
+        !strncmp(arg, "-B", 2) ||
+        !strncmp(arg, "-specs=", 7) ||
+        !strcmp(arg, "-pie") ||
+        !strcmp(arg, "-no-pie") ||
+        !strcmp(arg, "-static-pie"))
+        return 1;
+
+    if (!strncmp(arg, "-f", 2)) {
+        arg += 2;
+        if (!strncmp(arg, "no-", 3)) arg += 3;
+        if (!strcmp(arg, "pic") || !strcmp(arg, "PIC") ||
+            !strcmp(arg, "pie") || !strcmp(arg, "PIE"))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Lock or unlock a whole file, waiting as long as it takes */
+static int lockFile(int fd, short type)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &fl) != 0) {
+        if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+/* Get the key identifying this compiler and target, from the compiler and any
+ * flags that change the target. Returns -1 if the compiler can't be found. */
+static int sanityKey(char *cc, char **argv, char *key)
+{
+    struct Hash hash;
+    int i, j;
+
+    hashInit(&hash);
+    hashString(&hash, "mlibtool sanity 1");
+    if (hashProgram(&hash, cc) != 0)
+        return -1;
+    for (i = 1; argv[i]; i += j ? j : 1) {
+        j = targetFlag(argv, i);
+        if (j > 0) hashString(&hash, argv[i]);
+        if (j > 1) hashString(&hash, argv[i+1]);
+    }
+    hashHex(&hash, key);
+    return 0;
+}
+
+/* Open the sanity cache of this build tree, and get the key for this compiler
+ * and target in it. Returns -1 if we can't. */
+static int sanityCacheOpen(char *cc, char **argv, char *key)
+{
+    char *root, *name;
+    int fd;
+
+    if (sanityKey(cc, argv, key) != 0)
+        return -1;
+
+    if (!(root = buildTreeRoot())) return -1;
+    ORX(name, malloc, NULL, (strlen(root) + 18));
+    sprintf(name, "%s/.mlibtool-sanity", root);
+    fd = open(name, O_RDWR|O_CREAT, 0666);
+    free(name);
+    free(root);
+    return fd;
 }
 
-/* Check the cache for system sanity */
-static int systemCachedSanity(char *cc, char **argv)
+/* Look for a key in the sanity cache, returning its SANITY_* flags or -1 */
+static int sanityCacheLookup(int fd, char *key)
 {
+    char line[HASH_HEX_SZ + 2];
     FILE *f;
-    int cs = -1;
-    char *cacheName = cachedSanityName(cc, argv);
-    if (!cacheName) return -1;
-    f = fopen(cacheName, "r");
-    if (f) {
-        cs = fgetc(f);
-        if (cs == EOF) cs = -1;
-        else cs -= '0';
-        fclose(f);
+    int sanity = -1, c;
+
+    if (lseek(fd, 0, SEEK_SET) != 0 || (c = dup(fd)) < 0 ||
+        !(f = fdopen(c, "r")))
+        return -1;
+
+    /* each line is <key> <flags> */
+    while (fread(line, 1, sizeof(line), f) == sizeof(line)) {
+        if (line[HASH_HEX_SZ - 1] != ' ' || line[HASH_HEX_SZ + 1] != '\n')
+            break;
+        if (!strncmp(line, key, HASH_HEX_SZ - 1))
+            sanity = line[HASH_HEX_SZ] - '0';
     }
-    free(cacheName);
-    return cs;
+
+    fclose(f);
+    return sanity;
 }
 
-/* Is this system sane? */
-static int systemIsSane(char *cc, char **argv)
+/* Make a pipe whose ends won't leak into the processes we start */
+static int cloexecPipe(int fds[2])
+{
+    if (pipe(fds) != 0) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+/* Start a process with its stdin, stdout and stderr (where not -1) redirected,
+ * with posix_spawn if we have it, which is cheaper than fork for a process as
+ * large as we may become. Returns -1 if it can't be started. Any other file
+ * descriptors the child shouldn't keep must be close-on-exec. */
+static pid_t startProcess(char *const *cmd, int inFd, int outFd, int errFd)
+{
+    pid_t pid;
+#ifdef USE_POSIX_SPAWN
+    posix_spawn_file_actions_t fa;
+    int err;
+
+    if ((err = posix_spawn_file_actions_init(&fa)) != 0) {
+        errno = err;
+        return -1;
+    }
+    if (inFd != -1) posix_spawn_file_actions_adddup2(&fa, inFd, 0);
+    if (outFd != -1) posix_spawn_file_actions_adddup2(&fa, outFd, 1);
+    if (errFd != -1) posix_spawn_file_actions_adddup2(&fa, errFd, 2);
+    err = posix_spawnp(&pid, cmd[0], &fa, NULL, cmd, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+#else
+    pid = fork();
+    if (pid == 0) {
+        if ((inFd != -1 && dup2(inFd, 0) == -1) ||
+            (outFd != -1 && dup2(outFd, 1) == -1) ||
+            (errFd != -1 && dup2(errFd, 2) == -1)) {
+            perror("mlibtool: dup2");
+            _exit(1);
+        }
+        execvp(cmd[0], cmd);
+        perror(cmd[0]);
+        _exit(1);
+    }
+
+#endif
+    return pid;
+}
+
+/* Ask the preprocessor whether the target is sane. Returns SANITY_* flags. */
+static int systemProbeSanity(char *cc, char **argv)
 {
     pid_t pid;
     int pipei[2], pipeo[2];
-    int tmpi, sane, insane = 0;
+    int tmpi, j, k, sane, pie, insane = 0;
+    char **cppCmd;
     size_t i, bufused;
     ssize_t rd;
-    int slashes = 1;
 #define BUFSZ 32
     char buf[BUFSZ];
 
@@ -223,32 +587,36 @@ static int systemIsSane(char *cc, char **argv)
     static const char *sanityCheck =
         "#if " SANE "\n"
         "SYSTEM_IS_SANE\n"
+        "#endif\n"
+        "#if defined(__PIE__) || defined(__pie__)\n"
+        "SYSTEM_IS_PIE\n"
         "#endif";
 
-    /* we can cache sanity if we can make a simple filename */
-    if (strchr(cc, '/') == NULL) {
-        int cachedSanity = systemCachedSanity(cc, argv);
-        if (cachedSanity != -1) return cachedSanity;
-        slashes = 0;
-    }
-
-    ORX(tmpi, pipe, -1, (pipei));
-    ORX(tmpi, pipe, -1, (pipeo));
-    ORX(pid, fork, -1, ());
-    if (pid == 0) {
-        /* child process, read in preproc commands */
-        ORX(tmpi, dup2, -1, (pipei[0], 0));
-        close(pipei[0]); close(pipei[1]);
-        ORX(tmpi, dup2, -1, (pipeo[1], 1));
-        close(pipeo[0]); close(pipeo[1]);
-
-        /* and spawn the preprocessor */
-        execlp(cc, cc, "-E", "-", NULL);
-        perror(cc);
-        exit(1);
+    /* preprocess it with any flags that change the target */
+    for (j = 0; argv[j]; j++);
+    ORX(cppCmd, malloc, NULL, ((j + 3) * sizeof(char *)));
+    cppCmd[0] = cc;
+    for (j = 1, k = 1; argv[j]; j += tmpi ? tmpi : 1) {
+        tmpi = targetFlag(argv, j);
+        if (tmpi > 0) cppCmd[k++] = argv[j];
+        if (tmpi > 1) cppCmd[k++] = argv[j+1];
     }
+    cppCmd[k++] = "-E";
+    cppCmd[k++] = "-";
+    cppCmd[k] = NULL;
+
+    ORX(tmpi, cloexecPipe, -1, (pipei));
+    ORX(tmpi, cloexecPipe, -1, (pipeo));
+    pid = startProcess(cppCmd, pipei[0], pipeo[1], -1);
+    free(cppCmd);
     close(pipei[0]);
     close(pipeo[1]);
+    if (pid == -1) {
+        perror(cc);
+        close(pipei[1]);
+        close(pipeo[0]);
+        return 0;
+    }
 
     /* now send it the check */
     i = strlen(sanityCheck);
@@ -257,7 +625,7 @@ static int systemIsSane(char *cc, char **argv)
     close(pipei[1]);
 
     /* and read its input */
-    sane = 0;
+    sane = pie = 0;
     bufused = 0;
     while ((rd = read(pipeo[0], buf + bufused, BUFSZ - bufused)) > 0 ||
            bufused) {
@@ -266,6 +634,8 @@ static int systemIsSane(char *cc, char **argv)
 
         if (!strncmp(buf, "SYSTEM_IS_SANE", 14))
             sane = 1;
+        else if (!strncmp(buf, "SYSTEM_IS_PIE", 13))
+            pie = 1;
 
         for (i = 0; i < bufused && buf[i] != '\n'; i++);
         if (i < bufused) i++;
@@ -282,141 +652,1453 @@ static int systemIsSane(char *cc, char **argv)
 
     /* finished */
     if (insane) sane = 0;
+    return (sane ? SANITY_SANE : 0) | (pie ? SANITY_PIE : 0);
+}
 
-    /* cache it */
-    if (!slashes)
-        systemCacheSanity(cc, argv, sane);
+/* Is this system sane? Returns SANITY_* flags, from the build tree's cache if
+ * possible. */
+static int systemIsSane(char *cc, char **argv)
+{
+    char key[HASH_HEX_SZ], line[HASH_HEX_SZ + 3];
+    int fd, sanity;
+
+    fd = sanityCacheOpen(cc, argv, key);
+    if (fd < 0)
+        return systemProbeSanity(cc, argv);
+
+    lockFile(fd, F_RDLCK);
+    sanity = sanityCacheLookup(fd, key);
+    lockFile(fd, F_UNLCK);
+
+    if (sanity < 0) {
+        /* only one process probes at a time, and the others will wait for the
+         * lock and then find its answer */
+        lockFile(fd, F_WRLCK);
+        sanity = sanityCacheLookup(fd, key);
+        if (sanity < 0) {
+            sanity = systemProbeSanity(cc, argv);
+            sprintf(line, "%s %c\n", key, '0' + sanity);
+            if (lseek(fd, 0, SEEK_END) >= 0 &&
+                write(fd, line, HASH_HEX_SZ + 2) != HASH_HEX_SZ + 2) {
+                /* never mind, we just won't have cached it */
+            }
+        }
+        lockFile(fd, F_UNLCK);
+    }
 
-    return sane;
+    close(fd);
+    return sanity;
 }
 
 
-/* our modes */
-enum Mode {
-    MODE_UNKNOWN = 0,
-    MODE_COMPILE,
-    MODE_LINK,
-    MODE_INSTALL
-};
+/* Run a probe command, feeding it input and keeping the start of its output
+ * in out (if out is not NULL). Returns nonzero if it failed. */
+static int runProbe(char **cmd, const char *input, char *out, size_t outSz)
+{
+    pid_t pid;
+    int pipei[2], pipeo[2];
+    int tmpi, fail = 0;
+    size_t i, used = 0;
+    ssize_t rd;
+    char buf[BUFSIZ];
 
-/* options necessary to handle modes */
-struct Options {
-    int dryRun, quiet, retryIfFail;
-    int buildShared, buildStatic; /* also effects -fPIC in .o files */
+    ORX(tmpi, cloexecPipe, -1, (pipei));
+    ORX(tmpi, cloexecPipe, -1, (pipeo));
+    pid = startProcess(cmd, pipei[0], pipeo[1], -1);
+    close(pipei[0]);
+    close(pipeo[1]);
+    if (pid == -1) {
+        close(pipei[1]);
+        close(pipeo[0]);
+        return 1;
+    }
 
-    int arglt; /* where the libtool command starts */
-    int argc;
-    char **argv, **cmd;
-};
+    i = strlen(input);
+    if (write(pipei[1], input, i) != (ssize_t) i)
+        fail = 1;
+    close(pipei[1]);
 
-/* redirect to libtool */
-static void execLibtool(struct Options *opt)
+    while ((rd = read(pipeo[0], buf, BUFSIZ)) > 0) {
+        for (i = 0; out && i < (size_t) rd && used < outSz - 1; i++)
+            out[used++] = buf[i];
+    }
+    close(pipeo[0]);
+    if (out) out[used] = '\0';
+
+    if (waitpid(pid, &tmpi, 0) != pid || tmpi != 0)
+        fail = 1;
+    return fail;
+}
+
+/* Probe everything we need to know about a compiler and target, and write it
+ * to a profile that later runs can read instead of probing. Returns nonzero
+ * on failure. */
+static int writeProfile(char *file, char **cmd)
 {
-    int arglt = opt->arglt;
-    char **argv = opt->argv;
+    char key[HASH_HEX_SZ], target[256];
+    char **probeCmd, *tmpFile;
+    int sanity, wholeArchive, newDtags, i, j, k;
+    FILE *f;
 
-    if (!opt->quiet)
-        fprintf(stderr, "mlibtool: unsupported configuration, trying libtool (%s)\n", argv[arglt]);
+    if (!cmd[0]) {
+        fprintf(stderr, "mlibtool: --write-profile needs a compiler\n");
+        return 1;
+    }
+    if (sanityKey(cmd[0], cmd, key) != 0) {
+        perror(cmd[0]);
+        return 1;
+    }
+    sanity = systemProbeSanity(cmd[0], cmd);
+
+    ORX(tmpFile, malloc, NULL, (strlen(file) + 4*sizeof(long) + 8));
+    sprintf(tmpFile, "%s.mlt%ld", file, (long) getpid());
+
+    /* probe commands are the compiler with the target flags, and then some */
+    for (i = 0; cmd[i]; i++);
+    ORX(probeCmd, malloc, NULL, ((i + 12) * sizeof(char *)));
+    probeCmd[0] = cmd[0];
+    for (i = 1, k = 1; cmd[i]; i += j ? j : 1) {
+        j = targetFlag(cmd, i);
+        if (j > 0) probeCmd[k++] = cmd[i];
+        if (j > 1) probeCmd[k++] = cmd[i+1];
+    }
 
-    execvp(argv[arglt], argv + arglt);
-    perror(argv[arglt]);
-    exit(1);
+    /* what are we targeting? */
+    probeCmd[k] = "-dumpmachine";
+    probeCmd[k+1] = NULL;
+    if (runProbe(probeCmd, "", target, sizeof(target)) != 0)
+        target[0] = '\0';
+    target[strcspn(target, "\n")] = '\0';
+
+    /* can we link in whole archives? */
+    probeCmd[k] = "-shared";
+    probeCmd[k+1] = "-fPIC";
+    probeCmd[k+2] = "-x";
+    probeCmd[k+3] = "c";
+    probeCmd[k+4] = "-";
+    probeCmd[k+5] = "-o";
+    probeCmd[k+6] = tmpFile;
+    probeCmd[k+7] = "-Wl,--whole-archive";
+    probeCmd[k+8] = "-Wl,--no-whole-archive";
+    probeCmd[k+9] = NULL;
+    wholeArchive = (sanity & SANITY_SANE) &&
+        runProbe(probeCmd, "int mlibtool_probe;\n", NULL, 0) == 0;
+    unlink(tmpFile);
+
+    /* can we ask for an RPATH rather than a RUNPATH? */
+    probeCmd[k+7] = "-Wl,--disable-new-dtags";
+    probeCmd[k+8] = NULL;
+    newDtags = (sanity & SANITY_SANE) &&
+        runProbe(probeCmd, "int mlibtool_probe;\n", NULL, 0) == 0;
+    unlink(tmpFile);
+    free(probeCmd);
+
+    /* and write it all out */
+    if (!(f = fopen(tmpFile, "w"))) {
+        perror(tmpFile);
+        free(tmpFile);
+        return 1;
+    }
+    fprintf(f, "# mlibtool target profile\n"
+               "cc=%s\n"
+               "key=%s\n"
+               "target=%s\n"
+               "sane=%d\n"
+               "pie=%d\n"
+               "whole_archive=%d\n"
+               "disable_new_dtags=%d\n",
+               cmd[0], key, target,
+               !!(sanity & SANITY_SANE), !!(sanity & SANITY_PIE),
+               wholeArchive, newDtags);
+    if (fclose(f) != 0 || rename(tmpFile, file) != 0) {
+        perror(file);
+        unlink(tmpFile);
+        free(tmpFile);
+        return 1;
+    }
+    free(tmpFile);
+    return 0;
 }
 
-/* Generic function to spawn a child and wait for it, exiting if the child
- * fails. */
-static void spawn(struct Options *opt, char *const *cmd)
+/* With MLIBTOOL_TRACE set to a file, every mlibtool process appends Chrome
+ * trace events to it, for chrome://tracing or Perfetto to show. Each event is
+ * one write to the file opened O_APPEND, so the many processes of a parallel
+ * build don't garble each other's events. */
+struct Trace {
+    int fd;
+    pid_t pid; /* the process whose invocation we're tracing */
+    double start;
+    char *name, *args; /* the invocation's event, if it's to have one */
+    int fallback;
+};
+static struct Trace trace = {-1, 0, 0, NULL, NULL, 0};
+
+/* when the children we're yet to wait for were started, in a table that grows
+ * as needed */
+static struct TraceChild {
+    pid_t pid;
+    double start;
+} *traceChildren = NULL;
+static size_t traceChildrenSz = 0;
+
+/* a line of JSON being built. If anything can't be allocated, it's dropped. */
+struct TraceLine {
+    char *buf;
+    size_t used, sz;
+    int failed;
+};
+
+/* the time in microseconds, or 0 if we're not tracing */
+static double traceNow(void)
 {
-    size_t i;
-    int fail = 0;
+    struct timeval tv;
+    if (trace.fd < 0) return 0;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
 
-    /* output the command */
-    if (!opt->quiet) {
-        fprintf(stderr, "mlibtool:");
-        for (i = 0; cmd[i]; i++)
-            fprintf(stderr, " %s", cmd[i]);
-        fprintf(stderr, "\n");
-    }
+static double traceMicros(struct timeval *tv)
+{
+    return tv->tv_sec * 1e6 + tv->tv_usec;
+}
 
-    /* and run it */
-    if (!opt->dryRun) {
-        pid_t pid;
-        int tmpi;
-        ORL(pid, fork, -1, ());
-        if (pid == 0) {
-            execvp(cmd[0], cmd);
-            perror(cmd[0]);
-            exit(1);
+static void traceAdd(struct TraceLine *line, const char *str)
+{
+    size_t len = strlen(str), sz;
+    char *buf;
+
+    if (line->failed) return;
+    if (line->used + len + 1 > line->sz) {
+        for (sz = line->sz ? line->sz : 256; line->used + len + 1 > sz; sz *= 2);
+        if (!(buf = realloc(line->buf, sz))) {
+            line->failed = 1;
+            return;
         }
-        if (waitpid(pid, &tmpi, 0) != pid) {
-            perror(cmd[0]);
-            fail = 1;
-        } else if (tmpi != 0)
-            fail = 1;
+        line->buf = buf;
+        line->sz = sz;
     }
+    memcpy(line->buf + line->used, str, len + 1);
+    line->used += len;
+}
 
-    if (fail) {
-        if (opt->retryIfFail) {
-            execLibtool(opt);
+/* add the inside of a JSON string */
+static void traceAddEscaped(struct TraceLine *line, const char *str)
+{
+    char esc[8];
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            esc[2] = '\0';
+        } else if (c < 0x20) {
+            sprintf(esc, "\\u%04x", c);
         } else {
-            exit(1);
+            esc[0] = c;
+            esc[1] = '\0';
         }
+        traceAdd(line, esc);
     }
 }
 
-/* Check for sanity by reading a .lo file. If cc is provided, fall back to that
- * if no .lo files are found. */
-static int checkLoSanity(struct Options *opt, char *cc)
+static void traceAddString(struct TraceLine *line, const char *str)
+{
+    traceAdd(line, "\"");
+    traceAddEscaped(line, str);
+    traceAdd(line, "\"");
+}
+
+/* add a command as one JSON string */
+static void traceAddCommand(struct TraceLine *line, char *const *cmd)
 {
-    int sane = 0, foundlo = 0;
     size_t i;
+    traceAdd(line, "\"");
+    for (i = 0; cmd[i]; i++) {
+        if (i) traceAdd(line, " ");
+        traceAddEscaped(line, cmd[i]);
+    }
+    traceAdd(line, "\"");
+}
 
-    /* look for a .lo file and check it for sanity */
-    for (i = 1; opt->cmd[i]; i++) {
-        char *arg = opt->cmd[i];
-        if (arg[0] != '-') {
-            char *ext = strrchr(arg, '.');
-            if (ext && (!strcmp(ext, ".lo") || !strcmp(ext, ".la"))) {
-                FILE *f;
+/* add a file's absolute path as a JSON string, so that invocations in
+ * different directories name it the same way */
+static void traceAddFile(struct TraceLine *line, const char *name)
+{
+    char *real, *dirC, *baseC;
 
-                foundlo = 1;
-                f = fopen(arg, "r");
-                if (f) {
-                    char buf[sizeof(SANE_HEADER)];
-                    fgets(buf, sizeof(SANE_HEADER), f);
-                    if (!strcmp(buf, SANE_HEADER)) sane = 1;
-                    fclose(f);
-                    break;
-                }
-            }
-        }
+    if ((real = realpath(name, NULL))) {
+        traceAddString(line, real);
+        free(real);
+        return;
     }
 
-    if (!foundlo && cc)
-        return systemIsSane(cc, opt->cmd);
+    /* it may not have been made yet */
+    dirC = strdup(name);
+    baseC = strdup(name);
+    if (dirC && baseC && (real = realpath(dirname(dirC), NULL))) {
+        traceAdd(line, "\"");
+        traceAddEscaped(line, real);
+        traceAdd(line, "/");
+        traceAddEscaped(line, basename(baseC));
+        traceAdd(line, "\"");
+        free(real);
+    } else {
+        traceAddString(line, name);
+    }
+    free(dirC);
+    free(baseC);
+}
 
-    return sane;
+/* Write an event that took dur microseconds from start, or an instant event
+ * if dur is negative. args are the members of its args object, or NULL. */
+static void traceEvent(const char *cat, const char *name, double start,
+                       double dur, const char *args)
+{
+    struct TraceLine line;
+    char buf[128];
+
+    if (trace.fd < 0) return;
+    memset(&line, 0, sizeof(line));
+    traceAdd(&line, "{\"name\":");
+    traceAddString(&line, name);
+    traceAdd(&line, ",\"cat\":");
+    traceAddString(&line, cat);
+    if (dur < 0)
+        sprintf(buf, ",\"ph\":\"i\",\"s\":\"p\",\"ts\":%.0f", start);
+    else
+        sprintf(buf, ",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f", start, dur);
+    traceAdd(&line, buf);
+    sprintf(buf, ",\"pid\":%ld,\"tid\":%ld,\"args\":{",
+            (long) getpid(), (long) getpid());
+    traceAdd(&line, buf);
+    if (args) traceAdd(&line, args);
+    traceAdd(&line, "}},\n");
+
+    if (!line.failed &&
+        write(trace.fd, line.buf, line.used) != (ssize_t) line.used) {
+        /* nowhere to complain */
+    }
+    free(line.buf);
 }
 
+/* Start tracing, if MLIBTOOL_TRACE asks us to */
+static void traceOpen(void)
+{
+    char *file = getenv("MLIBTOOL_TRACE"), *tmpName;
+    int fd;
+
+    if (!file || !file[0]) return;
+
+    /* a new file starts with the [ of the JSON array, which must be there
+     * before anyone's events (the viewers don't need the ]) */
+    if (access(file, F_OK) != 0 &&
+        (tmpName = malloc(strlen(file) + 4*sizeof(long) + 5))) {
+        sprintf(tmpName, "%s.mlt%ld", file, (long) getpid());
+        if ((fd = open(tmpName, O_WRONLY|O_CREAT|O_TRUNC, 0666)) >= 0) {
+            if (write(fd, "[\n", 2) == 2 && close(fd) == 0 &&
+                link(tmpName, file) != 0) {
+                /* someone else made it first */
+            }
+            unlink(tmpName);
+        }
+        free(tmpName);
+    }
 
-static void usage(enum Mode mode);
+    if ((fd = open(file, O_WRONLY|O_APPEND)) < 0) {
+        perror(file);
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    trace.fd = fd;
+    trace.pid = getpid();
+}
 
-/* mode functions */
-static void ltcompile(struct Options *);
-static void ltlink(struct Options *);
-static void ltinstall(struct Options *);
+static int compileArgTakesValue(char *arg);
 
-int main(int argc, char **argv)
+/* Describe the invocation being traced, by its mode, its output and its
+ * inputs, or don't give it an event if mode is NULL */
+static void traceInvocation(const char *mode, char **cmd)
 {
-    int argi;
+    struct TraceLine name, args;
+    char *output = NULL, *source = NULL, *ext;
+    int compile, inputs = 0;
+    size_t i;
 
-    /* options */
+    free(trace.name);
+    free(trace.args);
+    trace.name = trace.args = NULL;
+    if (trace.fd < 0 || !mode) return;
+    compile = !strcmp(mode, "compile");
+
+    memset(&args, 0, sizeof(args));
+    traceAdd(&args, "\"mode\":");
+    traceAddString(&args, mode);
+    traceAdd(&args, ",\"inputs\":[");
+    for (i = 1; cmd[i]; i++) {
+        if (!strcmp(cmd[i], "-o") && cmd[i+1]) {
+            output = cmd[++i];
+
+        } else if (compile) {
+            /* as in ltcompile, the source is the last non-option */
+            if (cmd[i][0] != '-')
+                source = cmd[i];
+            else if (compileArgTakesValue(cmd[i]) && cmd[i+1])
+                i++;
+
+        } else if ((ext = strrchr(cmd[i], '.')) &&
+                   (!strcmp(ext, ".lo") || !strcmp(ext, ".la"))) {
+            if (inputs++) traceAdd(&args, ",");
+            traceAddFile(&args, cmd[i]);
+
+        }
+    }
+    if (source) traceAddFile(&args, source);
+    traceAdd(&args, "]");
+    if (output) {
+        traceAdd(&args, ",\"output\":");
+        traceAddFile(&args, output);
+    }
+
+    memset(&name, 0, sizeof(name));
+    traceAdd(&name, mode);
+    if (output || source) {
+        traceAdd(&name, " ");
+        traceAdd(&name, output ? output : source);
+    }
+
+    if (args.failed || name.failed) {
+        free(args.buf);
+        free(name.buf);
+        return;
+    }
+    trace.name = name.buf;
+    trace.args = args.buf;
+}
+
+/* Finish the invocation's event, if this is the process it's for */
+static void traceExit(void)
+{
+    struct TraceLine args;
+
+    if (trace.fd < 0 || trace.pid != getpid() || !trace.name) return;
+    memset(&args, 0, sizeof(args));
+    traceAdd(&args, trace.args);
+    traceAdd(&args, trace.fallback ? ",\"fallback\":1" : ",\"fallback\":0");
+    if (!args.failed)
+        traceEvent("invocation", trace.name, trace.start,
+                   traceNow() - trace.start, args.buf);
+    free(args.buf);
+    traceInvocation(NULL, NULL);
+}
+
+/* We're about to become libtool, so finish up */
+static void traceFallback(char *const *cmd)
+{
+    struct TraceLine args;
+
+    if (trace.fd < 0) return;
+    memset(&args, 0, sizeof(args));
+    traceAdd(&args, "\"cmd\":");
+    traceAddCommand(&args, cmd);
+    if (!args.failed)
+        traceEvent("fallback", "libtool", traceNow(), -1, args.buf);
+    free(args.buf);
+    trace.fallback = 1;
+    traceExit();
+}
+
+/* Note when a child was started, for its event */
+static void traceStarted(pid_t pid)
+{
+    struct TraceChild *grown;
+    size_t i;
+    if (trace.fd < 0) return;
+    for (i = 0; i < traceChildrenSz && traceChildren[i].pid; i++);
+    if (i == traceChildrenSz) {
+        /* if it can't grow, the child's event just starts when it ends */
+        grown = realloc(traceChildren,
+                        (traceChildrenSz + 16) * sizeof(struct TraceChild));
+        if (!grown) return;
+        traceChildren = grown;
+        memset(traceChildren + traceChildrenSz, 0,
+               16 * sizeof(struct TraceChild));
+        traceChildrenSz += 16;
+    }
+    traceChildren[i].pid = pid;
+    traceChildren[i].start = traceNow();
+}
+
+/* Wait for a child, as waitpid, and if we're tracing give it an event with
+ * the CPU time and memory it used */
+static pid_t traceWait(pid_t pid, int *status, char *const *cmd)
+{
+    struct TraceLine args;
+    struct rusage usage;
+    double start, end, user, sys;
+    char buf[128], *name;
+    size_t i;
+#ifndef __linux__
+    struct rusage before;
+#endif
+
+    if (trace.fd < 0) return waitpid(pid, status, 0);
+
+#ifdef __linux__
+    pid = wait4(pid, status, 0, &usage);
+    user = traceMicros(&usage.ru_utime);
+    sys = traceMicros(&usage.ru_stime);
+#else
+    /* this covers every child waited for, so take off what came before. The
+     * peak memory is only the peak of them all. */
+    getrusage(RUSAGE_CHILDREN, &before);
+    pid = waitpid(pid, status, 0);
+    getrusage(RUSAGE_CHILDREN, &usage);
+    user = traceMicros(&usage.ru_utime) - traceMicros(&before.ru_utime);
+    sys = traceMicros(&usage.ru_stime) - traceMicros(&before.ru_stime);
+#endif
+    if (pid == -1) return pid;
+
+    start = end = traceNow();
+    for (i = 0; i < traceChildrenSz; i++) {
+        if (traceChildren[i].pid == pid) {
+            traceChildren[i].pid = 0;
+            start = traceChildren[i].start;
+            break;
+        }
+    }
+
+    memset(&args, 0, sizeof(args));
+    traceAdd(&args, "\"cmd\":");
+    traceAddCommand(&args, cmd);
+    sprintf(buf, ",\"status\":%d,\"user_us\":%.0f,\"sys_us\":%.0f,\"maxrss_kb\":%ld",
+            *status, user, sys, (long) usage.ru_maxrss);
+    traceAdd(&args, buf);
+    if ((name = strrchr(cmd[0], '/'))) name++;
+    else name = cmd[0];
+    if (!args.failed)
+        traceEvent("spawn", name, start, end - start, args.buf);
+    free(args.buf);
+    return pid;
+}
+
+/* an event read back from a trace */
+struct ReportEvent {
+    char *line; /* everything else points into this */
+    char *name, *cat, *mode, *output, *cmd;
+    char **inputs;
+    size_t inputsUsed;
+    double ts, dur, cpu;
+    long pid;
+    int fallback;
+
+    /* for invocations */
+    double pic, nonPic; /* time spent compiling each */
+    double path; /* the longest path of invocations ending here */
+    struct ReportEvent *from; /* the previous invocation on that path */
+    struct ReportEvent *nextPid, *nextOutput;
+    int state;
+};
+
+#define REPORT_BUCKETS 1024
+#define REPORT_TOP 10
+#define REPORT_BUILD_GAP 10e6 /* microseconds idle that separate two builds */
+
+/* read a JSON string in place. Returns the rest, or NULL if it isn't one. */
+static char *reportString(char *p, char **str)
+{
+    char *out;
+    unsigned int c;
+
+    if (*p != '"') return NULL;
+    *str = out = ++p;
+    while (*p != '"') {
+        if (!*p) return NULL;
+        if (*p == '\\') {
+            p++;
+            if (*p == 'u') {
+                if (sscanf(p + 1, "%4x", &c) != 1) return NULL;
+                *out++ = (c < 0x100) ? c : '?';
+                p += 5;
+                continue;
+            }
+            if (!*p) return NULL;
+        }
+        *out++ = *p++;
+    }
+    *out = '\0';
+    return p + 1;
+}
+
+/* read an object written by traceEvent, and the args object in it, into ev.
+ * Returns the rest, or NULL if it isn't one. */
+static char *reportObject(char *p, struct ReportEvent *ev)
+{
+    char *key, *str, *end;
+    double num;
+
+    if (*p++ != '{') return NULL;
+    while (*p != '}') {
+        if (!(p = reportString(p, &key)) || *p++ != ':') return NULL;
+
+        if (*p == '"') {
+            if (!(p = reportString(p, &str))) return NULL;
+            if (!strcmp(key, "name")) ev->name = str;
+            else if (!strcmp(key, "cat")) ev->cat = str;
+            else if (!strcmp(key, "mode")) ev->mode = str;
+            else if (!strcmp(key, "output")) ev->output = str;
+            else if (!strcmp(key, "cmd")) ev->cmd = str;
+
+        } else if (*p == '[') {
+            for (p++; *p != ']'; ) {
+                if (!(p = reportString(p, &str))) return NULL;
+                if (!strcmp(key, "inputs")) {
+                    ORX(ev->inputs, realloc, NULL,
+                        (ev->inputs, (ev->inputsUsed + 1) * sizeof(char *)));
+                    ev->inputs[ev->inputsUsed++] = str;
+                }
+                if (*p == ',') p++;
+                else if (*p != ']') return NULL;
+            }
+            p++;
+
+        } else if (*p == '{') {
+            if (!(p = reportObject(p, ev))) return NULL;
+
+        } else {
+            num = strtod(p, &end);
+            if (end == p) return NULL;
+            p = end;
+            if (!strcmp(key, "ts")) ev->ts = num;
+            else if (!strcmp(key, "dur")) ev->dur = num;
+            else if (!strcmp(key, "pid")) ev->pid = (long) num;
+            else if (!strcmp(key, "fallback")) ev->fallback = (int) num;
+            else if (!strcmp(key, "user_us") || !strcmp(key, "sys_us"))
+                ev->cpu += num;
+
+        }
+
+        if (*p == ',') p++;
+        else if (*p != '}') return NULL;
+    }
+    return p + 1;
+}
+
+/* is this word in this command? */
+static int reportHasWord(const char *cmd, const char *word)
+{
+    size_t len = strlen(word);
+    const char *p;
+    for (p = cmd; (p = strstr(p, word)); p += len) {
+        if ((p == cmd || p[-1] == ' ') && (!p[len] || p[len] == ' '))
+            return 1;
+    }
+    return 0;
+}
+
+/* Is this compile command one that built a PIC object? mlibtool puts those in
+ * .libs, whatever flag it used for them. */
+static int reportPicCompile(const char *cmd)
+{
+    const char *p, *q;
+    size_t len;
+    for (p = cmd; (p = strstr(p, " -o ")); ) {
+        p += 4;
+        len = strcspn(p, " ");
+        if (!strncmp(p, ".libs/", 6)) return 1;
+        for (q = p; q + 7 <= p + len; q++)
+            if (!strncmp(q, "/.libs/", 7)) return 1;
+    }
+    return 0;
+}
+
+static size_t reportBucket(const char *str)
+{
+    struct Hash hash;
+    hashInit(&hash);
+    hashString(&hash, str);
+    return hash.lo % REPORT_BUCKETS;
+}
+
+/* the latest invocation that made this file */
+static struct ReportEvent *reportMaker(struct ReportEvent **byOutput,
+                                       const char *file)
+{
+    struct ReportEvent *ev;
+    for (ev = byOutput[reportBucket(file)]; ev; ev = ev->nextOutput)
+        if (!strcmp(ev->output, file)) return ev;
+    return NULL;
+}
+
+/* find the longest path of invocations ending with this one, through the
+ * invocations that made its inputs (before it started) */
+static double reportPath(struct ReportEvent **byOutput, struct ReportEvent *ev)
+{
+    struct ReportEvent *maker;
+    double path;
+    size_t i;
+
+    if (ev->state) return ev->path;
+    ev->state = 1;
+    ev->path = ev->dur;
+    for (i = 0; i < ev->inputsUsed; i++) {
+        maker = reportMaker(byOutput, ev->inputs[i]);
+        if (!maker || maker->ts >= ev->ts) continue;
+        path = reportPath(byOutput, maker) + ev->dur;
+        if (path > ev->path) {
+            ev->path = path;
+            ev->from = maker;
+        }
+    }
+    return ev->path;
+}
+
+/* what to call an invocation: what it made, relative to here if it's here */
+static const char *reportName(struct ReportEvent *ev, const char *cwd)
+{
+    const char *name = ev->output;
+    size_t len = strlen(cwd);
+    if (!name) name = ev->inputsUsed ? ev->inputs[0] : ev->name;
+    if (!strncmp(name, cwd, len) && name[len] == '/')
+        name += len + 1;
+    return name;
+}
+
+/* sort events by when they started */
+static int reportEarlier(const void *a, const void *b)
+{
+    double at = (*(struct ReportEvent *const *) a)->ts,
+           bt = (*(struct ReportEvent *const *) b)->ts;
+    return (at < bt) ? -1 : (at > bt) ? 1 : 0;
+}
+
+/* sort invocations slowest first */
+static int reportSlower(const void *a, const void *b)
+{
+    double ad = (*(struct ReportEvent *const *) a)->dur,
+           bd = (*(struct ReportEvent *const *) b)->dur;
+    return (ad < bd) ? 1 : (ad > bd) ? -1 : 0;
+}
+
+/* Summarize a trace written with MLIBTOOL_TRACE: where the time went, and
+ * what to look at to make the build faster. Returns the exit status. */
+static int writeReport(const char *file)
+{
+    struct ReportEvent **evs = NULL, **compiles, **links, *ev, *inv, *last;
+    struct ReportEvent *byPid[REPORT_BUCKETS], *byOutput[REPORT_BUCKETS];
+    size_t evsUsed = 0, evsSz = 0, compilesUsed = 0, linksUsed = 0;
+    size_t invocations = 0, installs = 0, fallbacks = 0, doubles = 0, steps;
+    size_t i, j, lbufsz, lbufused, builds = 0;
+    double start = 0, end = 0, runTime = 0, cpu = 0, doubleTime = 0, path;
+    double wall = 0, *spans;
+    char *lbuf, cwd[4096];
+    FILE *f;
+
+    if (!file || !file[0]) {
+        fprintf(stderr, "mlibtool: --report needs a file, or MLIBTOOL_TRACE\n");
+        return 1;
+    }
+    if (!(f = fopen(file, "r"))) {
+        perror(file);
+        return 1;
+    }
+    if (!getcwd(cwd, sizeof(cwd))) cwd[0] = '\0';
+
+    /* read in every event */
+    lbufsz = 256;
+    ORX(lbuf, malloc, NULL, (lbufsz));
+    while (fgets(lbuf, lbufsz, f)) {
+        lbufused = strlen(lbuf);
+
+        /* read in the remainder of the line */
+        while (lbuf[lbufused-1] != '\n') {
+            lbufsz *= 2;
+            ORX(lbuf, realloc, NULL, (lbuf, lbufsz));
+            if (!fgets(lbuf + lbufused, lbufsz - lbufused, f)) break;
+            lbufused = strlen(lbuf);
+        }
+        if (lbuf[0] != '{') continue;
+
+        ORX(ev, calloc, NULL, (1, sizeof(struct ReportEvent)));
+        ORX(ev->line, strdup, NULL, (lbuf));
+        if (!reportObject(ev->line, ev) || !ev->cat) {
+            /* not one of ours, or cut off */
+            free(ev->inputs);
+            free(ev->line);
+            free(ev);
+            continue;
+        }
+
+        if (evsUsed >= evsSz) {
+            evsSz = evsSz ? evsSz * 2 : 256;
+            ORX(evs, realloc, NULL, (evs, evsSz * sizeof(struct ReportEvent *)));
+        }
+        evs[evsUsed++] = ev;
+    }
+    free(lbuf);
+    fclose(f);
+
+    /* split the trace into builds wherever nothing ran for a while, so that
+     * the time between builds added to the same trace isn't counted */
+    qsort(evs, evsUsed, sizeof(struct ReportEvent *), reportEarlier);
+    ORX(spans, malloc, NULL, ((evsUsed + 1) * sizeof(double)));
+    for (i = 0; i < evsUsed; i++) {
+        ev = evs[i];
+        if (!i || ev->ts > end + REPORT_BUILD_GAP) {
+            if (i) spans[builds++] = end - start;
+            start = ev->ts;
+            end = ev->ts + ev->dur;
+        } else if (ev->ts + ev->dur > end) {
+            end = ev->ts + ev->dur;
+        }
+    }
+    if (evsUsed) spans[builds++] = end - start;
+    for (i = 0; i < builds; i++) wall += spans[i];
+
+    /* index the invocations by process and by what they made */
+    memset(byPid, 0, sizeof(byPid));
+    memset(byOutput, 0, sizeof(byOutput));
+    ORX(compiles, malloc, NULL, ((evsUsed + 1) * sizeof(struct ReportEvent *)));
+    ORX(links, malloc, NULL, ((evsUsed + 1) * sizeof(struct ReportEvent *)));
+    for (i = 0; i < evsUsed; i++) {
+        ev = evs[i];
+        if (strcmp(ev->cat, "invocation") || !ev->mode) continue;
+
+        invocations++;
+        runTime += ev->dur;
+        if (ev->fallback) fallbacks++;
+        if (!strcmp(ev->mode, "compile")) compiles[compilesUsed++] = ev;
+        else if (!strcmp(ev->mode, "link")) links[linksUsed++] = ev;
+        else if (!strcmp(ev->mode, "install")) installs++;
+
+        j = (size_t) ev->pid % REPORT_BUCKETS;
+        ev->nextPid = byPid[j];
+        byPid[j] = ev;
+
+        if (ev->output && strcmp(ev->mode, "install")) {
+            last = reportMaker(byOutput, ev->output);
+            if (!last || last->ts < ev->ts) {
+                j = reportBucket(ev->output);
+                ev->nextOutput = byOutput[j];
+                byOutput[j] = ev;
+            }
+        }
+    }
+
+    /* give each command to the invocation that ran it */
+    for (i = 0; i < evsUsed; i++) {
+        ev = evs[i];
+        if (strcmp(ev->cat, "spawn") || !ev->cmd) continue;
+        cpu += ev->cpu;
+        for (inv = byPid[(size_t) ev->pid % REPORT_BUCKETS]; inv;
+             inv = inv->nextPid) {
+            if (inv->pid == ev->pid && inv->ts <= ev->ts &&
+                ev->ts <= inv->ts + inv->dur)
+                break;
+        }
+        if (!inv || strcmp(inv->mode, "compile") ||
+            reportHasWord(ev->cmd, "-E"))
+            continue;
+        if (reportPicCompile(ev->cmd))
+            inv->pic += ev->dur;
+        else
+            inv->nonPic += ev->dur;
+    }
+    for (i = 0; i < compilesUsed; i++) {
+        if (compiles[i]->pic > 0 && compiles[i]->nonPic > 0) {
+            doubles++;
+            doubleTime += compiles[i]->nonPic;
+        }
+    }
+
+    /* the critical path ends with the invocation with the longest one */
+    last = NULL;
+    for (i = 0; i < evsUsed; i++) {
+        ev = evs[i];
+        if (strcmp(ev->cat, "invocation") || !ev->mode) continue;
+        path = reportPath(byOutput, ev);
+        if (!last || path > last->path) last = ev;
+    }
+    for (steps = 0, ev = last; ev; ev = ev->from) steps++;
+
+    /* first the numbers worth tracking, one per line */
+    printf("invocations: %lu (compile %lu, link %lu, install %lu)\n",
+           (unsigned long) invocations, (unsigned long) compilesUsed,
+           (unsigned long) linksUsed, (unsigned long) installs);
+    printf("builds: %lu\n", (unsigned long) builds);
+    printf("wall time: %.3fs\n", wall / 1e6);
+    printf("mlibtool time: %.3fs\n", runTime / 1e6);
+    printf("command CPU time: %.3fs\n", cpu / 1e6);
+    printf("libtool fallbacks: %lu (%.1f%%)\n", (unsigned long) fallbacks,
+           invocations ? 100.0 * fallbacks / invocations : 0.0);
+    printf("double compiles: %lu (%.3fs on non-PIC objects)\n",
+           (unsigned long) doubles, doubleTime / 1e6);
+    printf("critical path: %.3fs (%lu steps)\n",
+           last ? last->path / 1e6 : 0.0, (unsigned long) steps);
+
+    /* then what to look at */
+    if (builds > 1) {
+        printf("\nwall time of each build:\n");
+        for (i = 0; i < builds; i++)
+            printf("%10.3fs\n", spans[i] / 1e6);
+    }
+
+    if (last) {
+        printf("\ncritical path, last first:\n");
+        for (ev = last; ev; ev = ev->from)
+            printf("%10.3fs  %s %s\n", ev->dur / 1e6, ev->mode,
+                   reportName(ev, cwd));
+    }
+
+    qsort(compiles, compilesUsed, sizeof(struct ReportEvent *), reportSlower);
+    if (compilesUsed)
+        printf("\nslowest compiles:\n");
+    for (i = 0; i < compilesUsed && i < REPORT_TOP; i++)
+        printf("%10.3fs  %s\n", compiles[i]->dur / 1e6,
+               reportName(compiles[i], cwd));
+
+    /* and what they cost with compiling their own objects */
+    qsort(links, linksUsed, sizeof(struct ReportEvent *), reportSlower);
+    if (linksUsed)
+        printf("\nslowest links (and with their objects):\n");
+    for (i = 0; i < linksUsed && i < REPORT_TOP; i++) {
+        ev = links[i];
+        path = ev->dur;
+        for (j = 0; j < ev->inputsUsed; j++) {
+            size_t len = strlen(ev->inputs[j]);
+            if (len > 3 && !strcmp(ev->inputs[j] + len - 3, ".lo") &&
+                (inv = reportMaker(byOutput, ev->inputs[j])))
+                path += inv->dur;
+        }
+        printf("%10.3fs %10.3fs  %s\n", ev->dur / 1e6, path / 1e6,
+               reportName(ev, cwd));
+    }
+
+    for (i = 0; i < evsUsed; i++) {
+        free(evs[i]->inputs);
+        free(evs[i]->line);
+        free(evs[i]);
+    }
+    free(evs);
+    free(spans);
+    free(compiles);
+    free(links);
+    return 0;
+}
+
+/* our modes */
+enum Mode {
+    MODE_UNKNOWN = 0,
+    MODE_COMPILE,
+    MODE_LINK,
+    MODE_INSTALL
+};
+
+/* options necessary to handle modes */
+struct Options {
+    int dryRun, quiet, retryIfFail;
+    int buildShared, buildStatic; /* also effects -fPIC in .o files */
+    int singleObject; /* 0: never, 1: if cc defaults to PIE, 2: always */
+    int defaultPie; /* cc builds PIE by default */
+    int preprocessOnce; /* share one preprocessor run between PIC and non-PIC */
+    char *cacheDir; /* object cache, or NULL */
+    int skipUnchanged; /* skip compiles whose manifest hasn't changed */
+    int keepUnchanged; /* keep outputs that are rebuilt identically */
+    int thinArchives; /* build convenience libraries as thin archives */
+    int noWrappers; /* link binaries to run from the build tree as they are */
+    int libFarm; /* wrappers find libraries in one directory of links */
+    int jobs; /* how many jobs to run at once, or 0 to leave it to make */
+    char *profile; /* target profile written by --write-profile, or NULL */
+    int profileSanity; /* SANITY_* flags from the profile, or -1 */
+    int wholeArchive; /* linker supports --whole-archive: 1, 0, or -1 if unknown */
+    int newDtags; /* linker supports --disable-new-dtags: 1, 0, or -1 if unknown */
+
+    int arglt; /* where the libtool command starts */
+    int argc;
+    char **argv, **cmd;
+};
+
+/* GNU make's jobserver. make gives us one job, and we need a token from it
+ * for each extra process we run at once. */
+#define JOBSERVER_MAX_TOKENS 256
+struct Jobserver {
+    int readFd, writeFd; /* -1 if there's no jobserver */
+    int readNonBlock; /* readFd is our own, non-blocking */
+    int held; /* tokens we've taken */
+    char tokens[JOBSERVER_MAX_TOKENS];
+    int local; /* extra jobs running without a jobserver */
+    pid_t child; /* running in the background with one of them */
+};
+
+/* this has to be global to return our tokens however we exit */
+static struct Jobserver jobserver = {-1, -1, 0, 0, {0}, 0, 0};
+
+/* Return every token we've taken, once the background child using one has
+ * finished */
+static void jobserverRelease(void)
+{
+    int status;
+    if (jobserver.child > 0) {
+        while (waitpid(jobserver.child, &status, 0) == -1 && errno == EINTR);
+        jobserver.child = 0;
+    }
+
+    while (jobserver.held > 0) {
+        jobserver.held--;
+        if (write(jobserver.writeFd, jobserver.tokens + jobserver.held, 1) != 1)
+            break;
+    }
+}
+
+/* Find the jobserver from MAKEFLAGS, in either the pipe (R,W) or fifo
+ * (fifo:PATH) style */
+static void jobserverInit(void)
+{
+    char *flags, *auth, *end, *path, buf[32];
+    int rfd, wfd, nbfd;
+    size_t len;
+
+    /* even without a jobserver, there may be a background child to wait
+     * for */
+    atexit(jobserverRelease);
+
+    if (!(flags = getenv("MAKEFLAGS"))) return;
+
+    /* the last one is the one that counts */
+    auth = NULL;
+    while ((end = strstr(flags, "--jobserver-"))) {
+        if (!strncmp(end, "--jobserver-auth=", 17))
+            auth = end + 17;
+        else if (!strncmp(end, "--jobserver-fds=", 16))
+            auth = end + 16;
+        flags = end + 12;
+    }
+    if (!auth) return;
+    len = strcspn(auth, " ");
+
+    if (!strncmp(auth, "fifo:", 5)) {
+        ORX(path, malloc, NULL, (len - 4));
+        memcpy(path, auth + 5, len - 5);
+        path[len - 5] = '\0';
+        rfd = open(path, O_RDONLY|O_NONBLOCK);
+        wfd = open(path, O_WRONLY|O_NONBLOCK);
+        free(path);
+        if (rfd < 0 || wfd < 0) {
+            if (rfd >= 0) close(rfd);
+            if (wfd >= 0) close(wfd);
+            return;
+        }
+        fcntl(rfd, F_SETFD, FD_CLOEXEC);
+        fcntl(wfd, F_SETFD, FD_CLOEXEC);
+        jobserver.readNonBlock = 1;
+
+    } else {
+        if (sscanf(auth, "%d,%d", &rfd, &wfd) != 2 || rfd < 0 || wfd < 0)
+            return;
+
+        /* make only leaves these open for commands it knows are recursive */
+        if (fcntl(rfd, F_GETFD) == -1 || fcntl(wfd, F_GETFD) == -1)
+            return;
+
+        /* we can't make make's pipe non-blocking, but we may be able to open
+         * it again */
+        sprintf(buf, "/dev/fd/%d", rfd);
+        if ((nbfd = open(buf, O_RDONLY|O_NONBLOCK)) >= 0) {
+            rfd = nbfd;
+            fcntl(rfd, F_SETFD, FD_CLOEXEC);
+            jobserver.readNonBlock = 1;
+        }
+
+    }
+
+    jobserver.readFd = rfd;
+    jobserver.writeFd = wfd;
+}
+
+/* Try to get a job for an extra process, without waiting. Returns 1 if we
+ * got one. Without a jobserver, we may run up to opt->jobs at once. */
+static int jobTake(struct Options *opt)
+{
+    struct pollfd pfd;
+
+    if (opt->dryRun)
+        return 0;
+
+    if (jobserver.readFd < 0) {
+        if (jobserver.local + 1 < opt->jobs) {
+            jobserver.local++;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (jobserver.held >= JOBSERVER_MAX_TOKENS)
+        return 0;
+
+    /* with make's own pipe, a token may go between poll and read, in which
+     * case we just wait for the next one */
+    if (!jobserver.readNonBlock) {
+        pfd.fd = jobserver.readFd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) != 1)
+            return 0;
+    }
+
+    if (read(jobserver.readFd, jobserver.tokens + jobserver.held, 1) == 1) {
+        jobserver.held++;
+        return 1;
+    }
+    return 0;
+}
+
+/* Give back a job taken by jobTake */
+static void jobGive(void)
+{
+    if (jobserver.readFd < 0) {
+        if (jobserver.local > 0) jobserver.local--;
+        return;
+    }
+
+    if (jobserver.held > 0) {
+        jobserver.held--;
+        if (write(jobserver.writeFd, jobserver.tokens + jobserver.held, 1) != 1)
+            perror("mlibtool: jobserver");
+    }
+}
+
+/* redirect to libtool */
+static void execLibtool(struct Options *opt)
+{
+    int arglt = opt->arglt;
+    char **argv = opt->argv;
+
+    jobserverRelease();
+
+    if (!opt->quiet)
+        fprintf(stderr, "mlibtool: unsupported configuration, trying libtool (%s)\n", argv[arglt]);
+
+    traceFallback(argv + arglt);
+    execvp(argv[arglt], argv + arglt);
+    perror(argv[arglt]);
+    exit(1);
+}
+
+/* Make a name to build an output under before it's put in place (allocates) */
+static char *tmpOutputName(struct Options *opt, const char *name)
+{
+    char *tmpName;
+    ORL(tmpName, malloc, NULL, (strlen(name) + 4*sizeof(long) + 5));
+    sprintf(tmpName, "%s.mlt%ld", name, (long) getpid());
+    return tmpName;
+}
+
+/* Put an output built under a temporary name in place, unless the file
+ * already there is identical, in which case it's kept along with its mtime.
+ * Frees tmpName. Returns 1 if the file was replaced. */
+static int commitOutput(struct Options *opt, char *tmpName, char *name)
+{
+    int replaced = 0;
+    if (sameContents(tmpName, name)) {
+        unlink(tmpName);
+        if (!opt->quiet)
+            fprintf(stderr, "mlibtool: %s is unchanged\n", name);
+    } else if (rename(tmpName, name) != 0) {
+        perror(name);
+        unlink(tmpName);
+        exit(1);
+    } else {
+        replaced = 1;
+    }
+    free(tmpName);
+    return replaced;
+}
+
+/* Replace a symlink only if it doesn't already point at target */
+static int updateSymlink(const char *target, const char *name)
+{
+    char buf[1024];
+    ssize_t len = readlink(name, buf, sizeof(buf) - 1);
+    if (len >= 0) {
+        buf[len] = '\0';
+        if (!strcmp(buf, target)) return 0;
+    }
+    unlink(name);
+    return symlink(target, name);
+}
+
+/* Does the compiler name other files after the output of this command, so that
+ * we can't build it under a different name? */
+static int outputNameMatters(char **cmd, size_t cmdLen)
+{
+    size_t i;
+    int haveMD = 0, haveMF = 0, haveMT = 0;
+
+    for (i = 1; i < cmdLen; i++) {
+        char *arg = cmd[i];
+        if (!strcmp(arg, "-MD") || !strcmp(arg, "-MMD"))
+            haveMD = 1;
+        else if (!strncmp(arg, "-MF", 3))
+            haveMF = 1;
+        else if (!strncmp(arg, "-MT", 3) || !strncmp(arg, "-MQ", 3))
+            haveMT = 1;
+        else if (!strncmp(arg, "-Wp,", 4) ||
+                 !strncmp(arg, "-save-temps", 11) ||
+                 !strcmp(arg, "-gsplit-dwarf"))
+            return 1;
+    }
+    return haveMD && (!haveMF || !haveMT);
+}
+
+/* Does this compile write files besides its output that the PIC and non-PIC
+ * compiles would both write, so that they can't run at once? */
+static int writesSideFiles(char *const *cmd)
+{
+    size_t i;
+
+    for (i = 1; cmd[i]; i++) {
+        char *arg = cmd[i];
+        if (!strcmp(arg, "-MD") || !strcmp(arg, "-MMD") ||
+            !strncmp(arg, "-Wp,", 4) ||
+            !strncmp(arg, "-save-temps", 11) ||
+            !strncmp(arg, "-fdump-", 7))
+            return 1;
+    }
+    return 0;
+}
+
+/* Output a command we're about to run, in one write so that it isn't mixed
+ * up with those of other jobs */
+static void showCommand(struct Options *opt, char *const *cmd)
+{
+    size_t i, len;
+    char *line;
+
+    if (opt->quiet) return;
+
+    len = 11;
+    for (i = 0; cmd[i]; i++)
+        len += strlen(cmd[i]) + 1;
+    ORL(line, malloc, NULL, (len));
+    strcpy(line, "mlibtool:");
+    len = 9;
+    for (i = 0; cmd[i]; i++) {
+        line[len++] = ' ';
+        strcpy(line + len, cmd[i]);
+        len += strlen(cmd[i]);
+    }
+    line[len++] = '\n';
+    fflush(stderr);
+    if (write(2, line, len) != (ssize_t) len) {
+        /* nowhere to complain */
+    }
+    free(line);
+}
+
+/* Start a child without waiting for it. If errFd is not -1, the child's stderr
+ * is redirected to it. Returns 0 (and runs nothing) in a dry run, or -1 if it
+ * couldn't be started. */
+static pid_t spawnStart(struct Options *opt, char *const *cmd, int errFd)
+{
+    pid_t pid;
+
+    showCommand(opt, cmd);
+    if (opt->dryRun)
+        return 0;
+
+    pid = startProcess(cmd, -1, -1, errFd);
+    if (pid == -1)
+        perror(cmd[0]);
+    else
+        traceStarted(pid);
+    return pid;
+}
+
+/* Wait for a child started by spawnStart. Returns nonzero if it failed. */
+static int spawnWait(pid_t pid, char *const *cmd)
+{
+    int tmpi;
+
+    if (pid == 0)
+        return 0;
+    if (pid == -1)
+        return 1;
+
+    if (traceWait(pid, &tmpi, cmd) != pid) {
+        perror(cmd[0]);
+        return 1;
+    }
+    return (tmpi != 0);
+}
+
+/* A spawned command failed: retry with libtool if we're allowed, or exit */
+static void spawnFailed(struct Options *opt)
+{
+    if (opt->retryIfFail) {
+        execLibtool(opt);
+    } else {
+        exit(1);
+    }
+}
+
+/* Generic function to spawn a child and wait for it, exiting if the child
+ * fails. */
+static void spawn(struct Options *opt, char *const *cmd)
+{
+    if (spawnWait(spawnStart(opt, cmd, -1), cmd))
+        spawnFailed(opt);
+}
+
+/* Run the last command of a mode, which nothing needs to follow. If we don't
+ * need to stay around to retry with libtool or trace it, there's no need to
+ * wait for it either, so just become it. */
+static void spawnLast(struct Options *opt, char *const *cmd)
+{
+    if (opt->retryIfFail || opt->dryRun || trace.fd >= 0) {
+        spawn(opt, cmd);
+        return;
+    }
+
+    showCommand(opt, cmd);
+    fflush(stdout);
+    jobserverRelease();
+    execvp(cmd[0], cmd);
+    perror(cmd[0]);
+    exit(1);
+}
+
+/* Read the target profile, if it was made for this compiler and target */
+static void readProfile(struct Options *opt)
+{
+    char key[HASH_HEX_SZ];
+    char *lbuf, *val;
+    size_t lbufsz, lbufused;
+    int matches = 0, sane = 0, pie = 0, wholeArchive = -1, newDtags = -1;
+    FILE *f;
+
+    if (!opt->profile || !opt->cmd[0]) return;
+    if (!(f = fopen(opt->profile, "r"))) return;
+    if (sanityKey(opt->cmd[0], opt->cmd, key) != 0) {
+        fclose(f);
+        return;
+    }
+
+    lbufsz = 32;
+    ORL(lbuf, malloc, NULL, (lbufsz));
+    while (fgets(lbuf, lbufsz, f)) {
+        lbufused = strlen(lbuf);
+
+        /* read in the remainder of the line */
+        while (lbuf[lbufused-1] != '\n') {
+            lbufsz *= 2;
+            ORL(lbuf, realloc, NULL, (lbuf, lbufsz));
+            if (!fgets(lbuf + lbufused, lbufsz - lbufused, f)) break;
+            lbufused = strlen(lbuf);
+        }
+        lbuf[strcspn(lbuf, "\n")] = '\0';
+
+        if (lbuf[0] == '#' || !(val = strchr(lbuf, '='))) continue;
+        *val++ = '\0';
+
+        if (!strcmp(lbuf, "key"))
+            matches = !strcmp(val, key);
+        else if (!strcmp(lbuf, "sane"))
+            sane = atoi(val);
+        else if (!strcmp(lbuf, "pie"))
+            pie = atoi(val);
+        else if (!strcmp(lbuf, "whole_archive"))
+            wholeArchive = atoi(val);
+        else if (!strcmp(lbuf, "disable_new_dtags"))
+            newDtags = atoi(val);
+    }
+    free(lbuf);
+    fclose(f);
+
+    if (matches) {
+        opt->profileSanity = (sane ? SANITY_SANE : 0) | (pie ? SANITY_PIE : 0);
+        opt->wholeArchive = wholeArchive;
+        opt->newDtags = newDtags;
+    }
+}
+
+/* Is the target sane? Returns SANITY_* flags, from the profile if we have
+ * one. */
+static int targetSanity(struct Options *opt, char *cc)
+{
+    int sanity;
+    double start;
+
+    if (opt->profileSanity >= 0)
+        return opt->profileSanity;
+    start = traceNow();
+    sanity = systemIsSane(cc, opt->cmd);
+    traceEvent("mlibtool", "sanity", start, traceNow() - start, NULL);
+    return sanity;
+}
+
+/* Check for sanity by reading a .lo file. If cc is provided, fall back to that
+ * if no .lo files are found. */
+static int checkLoSanity(struct Options *opt, char *cc)
+{
+    int sane = 0, foundlo = 0;
+    size_t i;
+
+    /* look for a .lo file and check it for sanity */
+    for (i = 1; opt->cmd[i]; i++) {
+        char *arg = opt->cmd[i];
+        if (arg[0] != '-') {
+            char *ext = strrchr(arg, '.');
+            if (ext && (!strcmp(ext, ".lo") || !strcmp(ext, ".la"))) {
+                FILE *f;
+
+                foundlo = 1;
+                f = fopen(arg, "r");
+                if (f) {
+                    char buf[sizeof(SANE_HEADER)];
+                    fgets(buf, sizeof(SANE_HEADER), f);
+                    if (!strcmp(buf, SANE_HEADER)) sane = 1;
+                    fclose(f);
+                    break;
+                }
+            }
+        }
+    }
+
+    if (!foundlo && cc)
+        return targetSanity(opt, cc) & SANITY_SANE;
+
+    return sane;
+}
+
+
+static void usage(enum Mode mode);
+
+/* mode functions */
+static void ltcompile(struct Options *);
+static int ltcompileBatch(struct Options *, int);
+static void ltlink(struct Options *);
+static void ltinstall(struct Options *);
+
+int main(int argc, char **argv)
+{
+    int argi;
+
+    /* options */
     struct Options opt;
     int insane = 0;
-    char *modeS = NULL;
+    char *modeS = NULL, *writeProfileFile = NULL;
     enum Mode mode = MODE_UNKNOWN;
     int sane = 0;
+
+    traceOpen();
+    trace.start = traceNow();
+    atexit(traceExit);
+
     memset(&opt, 0, sizeof(opt));
+    opt.singleObject = 1;
+    opt.preprocessOnce = 1;
+    opt.libFarm = 1;
+    opt.profileSanity = -1;
+    opt.wholeArchive = -1;
+    opt.newDtags = -1;
 
     /* mlibtool-specific options come first */
     for (argi = 1; argi < argc && argv[argi][0] == '-'; argi++) {
@@ -428,6 +2110,51 @@ int main(int argc, char **argv)
         } else if (!strcmp(arg, "--enable-shared")) {
             opt.buildShared = 1;
 
+        } else if (!strcmp(arg, "--single-object")) {
+            opt.singleObject = 2;
+
+        } else if (!strcmp(arg, "--no-single-object")) {
+            opt.singleObject = 0;
+
+        } else if (!strcmp(arg, "--no-preprocess-once")) {
+            opt.preprocessOnce = 0;
+
+        } else if (!strncmp(arg, "--cache-dir=", 12)) {
+            opt.cacheDir = arg + 12;
+
+        } else if (!strcmp(arg, "--skip-unchanged")) {
+            opt.skipUnchanged = 1;
+
+        } else if (!strcmp(arg, "--keep-unchanged")) {
+            opt.keepUnchanged = 1;
+
+        } else if (!strcmp(arg, "--thin-archives")) {
+            opt.thinArchives = 1;
+
+        } else if (!strcmp(arg, "--no-wrappers")) {
+            opt.noWrappers = 1;
+
+        } else if (!strcmp(arg, "--no-lib-farm")) {
+            opt.libFarm = 0;
+
+        } else if (!strncmp(arg, "--jobs=", 7)) {
+            opt.jobs = atoi(arg + 7);
+            if (opt.jobs < 0) opt.jobs = 0;
+
+        } else if (!strncmp(arg, "--profile=", 10)) {
+            opt.profile = arg + 10;
+
+        } else if (!strncmp(arg, "--write-profile=", 16)) {
+            writeProfileFile = arg + 16;
+            argi++;
+            break;
+
+        } else if (!strcmp(arg, "--report")) {
+            return writeReport(getenv("MLIBTOOL_TRACE"));
+
+        } else if (!strncmp(arg, "--report=", 9)) {
+            return writeReport(arg + 9);
+
         } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
             usage(MODE_UNKNOWN);
             exit(0);
@@ -440,6 +2167,19 @@ int main(int argc, char **argv)
 
     }
 
+    /* the rest is the compiler to profile */
+    if (writeProfileFile)
+        return writeProfile(writeProfileFile, argv + argi);
+
+    /* share make's jobs, if it has any to share */
+    jobserverInit();
+
+    /* the object cache may also come from the environment */
+    if (!opt.cacheDir)
+        opt.cacheDir = getenv("MLIBTOOL_CACHE_DIR");
+    if (opt.cacheDir && !opt.cacheDir[0])
+        opt.cacheDir = NULL;
+
     /* if neither static nor shared were specified, enabled both */
     if (!opt.buildStatic && !opt.buildShared)
         opt.buildStatic = opt.buildShared = 1;
@@ -504,6 +2244,8 @@ int main(int argc, char **argv)
     } else if (!strcmp(modeS, "install")) {
         mode = MODE_INSTALL;
     }
+    traceEvent("mlibtool", "args", trace.start, traceNow() - trace.start, NULL);
+    traceInvocation(modeS, opt.cmd);
 
     /* if they're asking for mode help, give it to them */
     if (argi < argc) {
@@ -515,8 +2257,13 @@ int main(int argc, char **argv)
 
     /* next argument is the compiler, use that to check for sanity */
     if (!insane) {
+        if (mode == MODE_COMPILE || mode == MODE_LINK)
+            readProfile(&opt);
+
         if (mode == MODE_COMPILE) {
-            sane = systemIsSane(opt.cmd[0], opt.cmd);
+            sane = targetSanity(&opt, opt.cmd[0]);
+            opt.defaultPie = !!(sane & SANITY_PIE);
+            sane &= SANITY_SANE;
         } else if (mode == MODE_LINK) {
             sane = checkLoSanity(&opt, opt.cmd[0]);
         } else if (mode == MODE_INSTALL) {
@@ -525,7 +2272,10 @@ int main(int argc, char **argv)
         }
     }
 
-    if (!sane) {
+    if (mode == MODE_COMPILE && ltcompileBatch(&opt, sane)) {
+        /* compiled several files, one by one */
+
+    } else if (!sane) {
         /* just go to libtool */
         execLibtool(&opt);
 
@@ -553,9 +2303,32 @@ static void usage(enum Mode mode)
            "mlibtool options:\n"
            "\t--enable-static: build non-PIC .o files and build .a files\n"
            "\t--enable-shared: build PIC .o files and build .so files\n"
-           "\t(if neither is specified, both --enable-static and --enable-shard are assumed)\n"
-           "\n"
-           "Options:\n"
+           "\t(if neither is specified, both --enable-static and --enable-shard are assumed)\n");
+    printf("\t--single-object: build only PIC .o files, and use them in place of\n"
+           "\t                 non-PIC .o files (default if cc builds PIE by default)\n"
+           "\t--no-single-object: always build separate PIC and non-PIC .o files\n"
+           "\t--no-preprocess-once: preprocess separately for PIC and non-PIC .o\n"
+           "\t                      files\n");
+    printf("\t--cache-dir=<dir>: cache compiled objects in <dir> (default:\n"
+           "\t                   $MLIBTOOL_CACHE_DIR)\n"
+           "\t--skip-unchanged: don't recompile if the source, the headers it\n"
+           "\t                  includes and the command are all unchanged\n"
+           "\t--keep-unchanged: keep old outputs, and their times, if they're\n"
+           "\t                  rebuilt identically\n");
+    printf("\t--thin-archives: build convenience libraries as thin archives\n"
+           "\t--no-wrappers: link binaries to find the build tree's libraries\n"
+           "\t               themselves, instead of making wrapper scripts\n"
+           "\t--no-lib-farm: make wrappers search every .libs directory, not\n"
+           "\t               one directory of links to the libraries\n");
+    printf("\t--jobs=<n>: run up to <n> jobs at once (default: as many as make's\n"
+           "\t           jobserver allows, or 1 without one)\n");
+    printf("\t--profile=<file>: read the target's properties from <file> instead\n"
+           "\t                  of probing the compiler\n"
+           "\t--write-profile=<file> <cc> [flags]: probe <cc> and write <file>\n"
+           "\t--report[=<file>]: summarize a trace written with MLIBTOOL_TRACE\n"
+           "\t                   (default: $MLIBTOOL_TRACE)\n"
+           "\n");
+    printf("Options:\n"
            "\t-n|--dry-run: display commands without modifying any files\n"
            "\t--mode=<mode>: use operational mode <mode>\n"
            "\n");
@@ -569,7 +2342,10 @@ static void usage(enum Mode mode)
         printf("Recognized mode options:\n");
 
     if (mode == MODE_COMPILE) {
-        printf("\t-o <name>: set the output file name to <name>\n"
+        printf("\t-o <name>: set the output file name to <name> (with several\n"
+               "\t           input files, give one -o per file, in order)\n"
+               "\t-no-suppress: show compiler output for both PIC and non-PIC\n"
+               "\t              builds\n"
                "\t-prefer-pic|-shared: build only a PIC file\n"
                "\t-prefer-non-pic|-static: build only a non-PIC file\n"
                "\t-Wc,<flag>: pass flag directly to cc\n"
@@ -591,41 +2367,705 @@ static void usage(enum Mode mode)
                "\t                                                to cc\n"
                "\n");
 
-        printf("Mode options ignored for GNU libtool compatibility:\n"
-               "\t-bindir <dir>\n"
-               "\n");
+        printf("Mode options ignored for GNU libtool compatibility:\n"
+               "\t-bindir <dir>\n"
+               "\n");
+
+        printf("Unsupported mode options:\n"
+               "\t-dlopen, -dlpreopen, -export-symbols, -export-symbols-regex,\n"
+               "\t-objectlist, -precious-files-regex, -release, -shared,\n"
+               "\t-shrext, -static, -static-libtool-libs, -weak\n"
+               "\n");
+
+    } else if (mode == MODE_INSTALL) {
+        printf("\t(none)\n\n");
+
+    }
+
+    printf("mlibtool is a mini version of libtool for sensible systems. If you're\n"
+        "compiling for Linux or BSD with supported invocation commands,\n"
+        "<target-libtool> will never be called.\n"
+        "\n"
+        "Unrecognized invocations will be redirected to <target-libtool>.\n");
+}
+
+/* Build both the PIC and non-PIC objects at once. Like libtool, we suppress
+ * the output of the second compile, as it's usually just a repeat of the
+ * first, so buffer it until we know whether it's needed. Returns nonzero on
+ * failure. */
+static int spawnBoth(struct Options *opt, int noSuppress,
+                     char *const *nonPicCmd, char *nonPicFile,
+                     char *const *picCmd, char *picFile)
+{
+    pid_t nonPicPid, picPid;
+    int nonPicFail, picFail;
+    FILE *picErr = NULL;
+
+    if (!opt->dryRun && !noSuppress)
+        picErr = tmpfile();
+    if (picErr)
+        fcntl(fileno(picErr), F_SETFD, FD_CLOEXEC);
+
+    /* run them at once if we can get a job for the second, and they won't
+     * both be writing the same dependency or dump files */
+    if (!writesSideFiles(nonPicCmd) && !writesSideFiles(picCmd) &&
+        jobTake(opt)) {
+        nonPicPid = spawnStart(opt, nonPicCmd, -1);
+        picPid = spawnStart(opt, picCmd, picErr ? fileno(picErr) : -1);
+        nonPicFail = spawnWait(nonPicPid, nonPicCmd);
+        picFail = spawnWait(picPid, picCmd);
+        jobGive();
+
+    } else {
+        nonPicFail = spawnWait(spawnStart(opt, nonPicCmd, -1), nonPicCmd);
+        picFail = spawnWait(
+            spawnStart(opt, picCmd, picErr ? fileno(picErr) : -1), picCmd);
+
+    }
+
+    if (picErr) {
+        if (picFail && !nonPicFail) {
+            /* the only report of this failure, so show it */
+            char buf[BUFSIZ];
+            size_t rd;
+            rewind(picErr);
+            while ((rd = fread(buf, 1, BUFSIZ, picErr)) > 0)
+                fwrite(buf, 1, rd, stderr);
+        }
+        fclose(picErr);
+    }
+
+    if (nonPicFail)
+        fprintf(stderr, "mlibtool: failed to build %s\n", nonPicFile);
+    if (picFail)
+        fprintf(stderr, "mlibtool: failed to build %s\n", picFile);
+    return nonPicFail || picFail;
+}
+
+/* Get the preprocessed file extension for a source file, or NULL if we don't
+ * know how to compile its preprocessed form */
+static const char *cppOutputExt(char *inName)
+{
+    char *ext = strrchr(inName, '.');
+    if (!ext || strchr(ext, '/')) return NULL;
+    ext++;
+    if (!strcmp(ext, "c"))
+        return "i";
+    if (!strcmp(ext, "cc") || !strcmp(ext, "cp") || !strcmp(ext, "cxx") ||
+        !strcmp(ext, "cpp") || !strcmp(ext, "CPP") || !strcmp(ext, "c++") ||
+        !strcmp(ext, "C"))
+        return "ii";
+    return NULL;
+}
+
+/* Can this compile command be split into a preprocessing and a compiling
+ * step? */
+static int canPreprocessOnce(char **cmd)
+{
+    size_t i;
+    int haveC = 0, haveMD = 0, haveMF = 0, haveMT = 0;
+
+    for (i = 1; cmd[i]; i++) {
+        char *arg = cmd[i];
+        if (arg[0] != '-') continue;
+
+        if (!strcmp(arg, "-c")) {
+            haveC = 1;
+
+        } else if (!strcmp(arg, "-MD") || !strcmp(arg, "-MMD")) {
+            haveMD = 1;
+
+        } else if (!strncmp(arg, "-MF", 3)) {
+            haveMF = 1;
+
+        } else if (!strncmp(arg, "-MT", 3) || !strncmp(arg, "-MQ", 3)) {
+            haveMT = 1;
+
+        } else if (!strcmp(arg, "-") ||
+                   !strcmp(arg, "-E") ||
+                   !strcmp(arg, "-S") ||
+                   !strcmp(arg, "-M") ||
+                   !strcmp(arg, "-MM") ||
+                   !strncmp(arg, "-x", 2) ||
+                   !strncmp(arg, "-save-temps", 11) ||
+                   !strncmp(arg, "-Wp,", 4) ||
+                   !strncmp(arg, "-fdirectives-only", 17) ||
+                   !strcmp(arg, "-traditional-cpp")) {
+            /* these either change what the preprocessor outputs, or what we
+             * would do with it */
+            return 0;
+
+        } else if (!strncmp(arg, "-Werror", 7) ||
+                   !strcmp(arg, "-pedantic-errors") ||
+                   !strncmp(arg, "-Wno-", 5) ||
+                   !strcmp(arg, "-g3") || !strcmp(arg, "-ggdb3") ||
+                   !strcmp(arg, "-fdebug-macro") ||
+                   !strcmp(arg, "-C") || !strcmp(arg, "-CC")) {
+            /* preprocessed source has no macros or comments left, which
+             * changes some warnings (and so what these make of them) and
+             * leaves macros out of the debug info */
+            return 0;
+
+        }
+    }
+
+    /* without an explicit target and file, dependencies would name the wrong
+     * file, or be put in the wrong place */
+    if (haveMD && (!haveMF || !haveMT)) return 0;
+
+    return haveC;
+}
+
+/* Is this identifier one of the macros that differ between PIC and non-PIC
+ * preprocessing? */
+static int isPicMacro(const char *ident, size_t len)
+{
+    static const char *const macros[] = {
+        "PIC", "__PIC__", "__pic__", "__PIE__", "__pie__", NULL
+    };
+    size_t i;
+    for (i = 0; macros[i]; i++)
+        if (strlen(macros[i]) == len && !memcmp(macros[i], ident, len))
+            return 1;
+    return 0;
+}
+
+/* Does this file mention the macros that differ between PIC and non-PIC
+ * preprocessing? Comments and literals are skipped. Unreadable files are
+ * assumed to. */
+static int sourceMentionsPic(char *name)
+{
+    struct stat sbuf;
+    char *data, *p, *end, *ident;
+    int fd, mentions = 0;
+
+    if ((fd = open(name, O_RDONLY)) < 0) return 1;
+    if (fstat(fd, &sbuf) != 0) {
+        close(fd);
+        return 1;
+    }
+    if (sbuf.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    data = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 1;
+    end = data + sbuf.st_size;
+
+#define IDENT_CHAR(c) ((c) == '_' || ((c) >= 'a' && (c) <= 'z') || \
+    ((c) >= 'A' && (c) <= 'Z') || ((c) >= '0' && (c) <= '9'))
+    for (p = data; p < end && !mentions; ) {
+        if (*p >= '0' && *p <= '9') {
+            /* a number, perhaps with digit separators (1'000) */
+            while (p < end && (IDENT_CHAR(*p) ||
+                               (*p == '\'' && p + 1 < end && IDENT_CHAR(p[1]))))
+                p++;
+
+        } else if (IDENT_CHAR(*p)) {
+            ident = p;
+            while (p < end && IDENT_CHAR(*p)) p++;
+            mentions = isPicMacro(ident, p - ident);
+
+        } else if (*p == '/' && p + 1 < end && p[1] == '*') {
+            /* block comment, whose end can't share the start's '*' */
+            ident = p;
+            for (p += 2; p < end && !(*p == '/' && p[-1] == '*' &&
+                                      p - ident >= 3); p++);
+            if (p < end) p++;
+
+        } else if (*p == '/' && p + 1 < end && p[1] == '/') {
+            /* line comment */
+            for (p += 2; p < end && *p != '\n'; p++)
+                if (*p == '\\' && p + 1 < end) p++;
+
+        } else if (*p == '"' || *p == '\'') {
+            /* literal, which can't span lines */
+            char quote = *p;
+            for (p++; p < end && *p != quote && *p != '\n'; p++)
+                if (*p == '\\' && p + 1 < end) p++;
+            if (p < end) p++;
+
+        } else {
+            p++;
+
+        }
+    }
+#undef IDENT_CHAR
+
+    munmap(data, sbuf.st_size);
+    return mentions;
+}
+
+/* Find every file that some preprocessed output came from, by its line
+ * markers, adding their names to sources (allocated). Returns -1 if the output
+ * can't be read. */
+static int cppOutputSources(struct Options *opt, char *cppFile,
+                            struct Buffer *sources)
+{
+    FILE *f;
+    char *lbuf;
+    size_t i, lbufsz, lbufused;
+
+    f = fopen(cppFile, "r");
+    if (!f) return -1;
+
+    lbufsz = 32;
+    ORL(lbuf, malloc, NULL, (lbufsz));
+
+    while (fgets(lbuf, lbufsz, f)) {
+        char *name, *rd, *wr;
+        lbufused = strlen(lbuf);
+
+        /* read in the remainder of the line */
+        while (lbuf[lbufused-1] != '\n') {
+            lbufsz *= 2;
+            ORL(lbuf, realloc, NULL, (lbuf, lbufsz));
+            if (!fgets(lbuf + lbufused, lbufsz - lbufused, f)) break;
+            lbufused = strlen(lbuf);
+        }
+
+        /* only line markers, # <line> "<file>" <flags> */
+        if (lbuf[0] != '#' || lbuf[1] != ' ' || lbuf[2] < '0' || lbuf[2] > '9')
+            continue;
+        name = strchr(lbuf, '"');
+        if (!name) continue;
+
+        /* unescape the name */
+        for (rd = wr = ++name; *rd && *rd != '"'; rd++) {
+            if (*rd == '\\' && rd[1]) rd++;
+            *wr++ = *rd;
+        }
+        *wr = '\0';
+        if (name[0] == '<') continue; /* <built-in> or <command-line> */
+
+        for (i = 0; i < sources->bufused && strcmp(sources->buf[i], name); i++);
+        if (i < sources->bufused) continue;
+
+        ORL(name, strdup, NULL, (name));
+        WRITE_BUFFER(*sources, name);
+    }
+
+    free(lbuf);
+    fclose(f);
+    return 0;
+}
+
+/* Could preprocessed output from these sources have been different with PIC
+ * flags? */
+static int sourcesMentionPic(struct Buffer *sources)
+{
+    size_t i;
+    for (i = 0; i < sources->bufused; i++)
+        if (sourceMentionsPic(sources->buf[i])) return 1;
+    return 0;
+}
+
+/* Make a command to compile preprocessed output from a compile command, by
+ * replacing the source with the preprocessed file and dropping the flags that
+ * only matter to the preprocessor */
+static void cppCompileCommand(struct Options *opt, struct Buffer *into,
+                              char **cmd, size_t inNamePos, char *cppFile)
+{
+    size_t i;
+
+    INIT_BUFFER(*into);
+    for (i = 0; cmd[i]; i++) {
+        char *arg = cmd[i];
+
+        if (i == inNamePos) {
+            WRITE_BUFFER(*into, cppFile);
+
+        } else if (!strcmp(arg, "-MD") || !strcmp(arg, "-MMD") ||
+                   !strcmp(arg, "-MP")) {
+            /* dependencies were generated by the preprocessor */
+
+        } else if ((!strcmp(arg, "-MF") || !strcmp(arg, "-MT") ||
+                    !strcmp(arg, "-MQ") || !strcmp(arg, "-include") ||
+                    !strcmp(arg, "-imacros")) && cmd[i+1]) {
+            i++;
+
+        } else if (!strncmp(arg, "-MF", 3) || !strncmp(arg, "-MT", 3) ||
+                   !strncmp(arg, "-MQ", 3)) {
+            /* joined form of the above */
+
+        } else {
+            WRITE_BUFFER(*into, arg);
+
+        }
+    }
+    WRITE_BUFFER(*into, NULL);
+}
+
+/* Get the key for an object in the object cache, from the compiler, the
+ * command to compile it from preprocessed output, and that output. Returns -1
+ * if there can be no key. */
+static int cacheKey(char **cmd, char *cppFile, char *key)
+{
+    struct Hash hash;
+    size_t i;
+    int debug = 0;
+
+    hashInit(&hash);
+    hashString(&hash, "mlibtool object cache 1");
+    if (hashProgram(&hash, cmd[0]) != 0)
+        return -1;
+
+    /* the command, with the file names that don't affect the output elided */
+    for (i = 1; cmd[i]; i++) {
+        if (!strcmp(cmd[i], cppFile))
+            hashString(&hash, "<input>");
+        else if (!strcmp(cmd[i-1], "-o"))
+            hashString(&hash, "<output>");
+        else
+            hashString(&hash, cmd[i]);
+        if (!strncmp(cmd[i], "-g", 2) && strcmp(cmd[i], "-g0"))
+            debug = 1;
+    }
+
+    /* debug info includes the build directory */
+    if (debug) {
+        char *cwd = currentDir();
+        if (!cwd) return -1;
+        hashString(&hash, cwd);
+        free(cwd);
+    }
+
+    if (hashFile(&hash, cppFile) != 0)
+        return -1;
+
+    hashHex(&hash, key);
+    return 0;
+}
+
+/* Get the path of an object in the cache, making its directory (allocates) */
+static char *cachePath(struct Options *opt, char *key, int mkdirs)
+{
+    char *path;
+    ORL(path, malloc, NULL, (strlen(opt->cacheDir) + HASH_HEX_SZ + 6));
+    if (mkdirs) mkdir(opt->cacheDir, 0777);
+    sprintf(path, "%s/%.2s", opt->cacheDir, key);
+    if (mkdirs) mkdir(path, 0777);
+    sprintf(path, "%s/%.2s/%s.o", opt->cacheDir, key, key);
+    return path;
+}
+
+/* Fill an object from the cache, if it's there. Returns 1 if it was. */
+static int cacheFetch(struct Options *opt, char *key, char *file)
+{
+    char *path = cachePath(opt, key, 0);
+    int found = 0;
+
+    if (access(path, F_OK) == 0) {
+        /* never a hardlink, as the object may be modified in place (by
+         * strip, say), which would modify the cache too */
+        unlink(file);
+        found = (copyFile(path, file, 0666) == 0);
+        if (found && !opt->quiet)
+            fprintf(stderr, "mlibtool: using cached %s\n", file);
+    }
+
+    free(path);
+    return found;
+}
+
+/* Put a newly-built object in the cache, ignoring failure */
+static void cacheStore(struct Options *opt, char *key, char *file)
+{
+    char *path = cachePath(opt, key, 1);
+    char *tmpPath;
+
+    /* write it under a temporary name, so others never see it half-done */
+    ORL(tmpPath, malloc, NULL, (strlen(path) + 4*sizeof(long) + 2));
+    sprintf(tmpPath, "%s.%ld", path, (long) getpid());
+    if (copyFile(file, tmpPath, 0666) == 0) {
+        if (rename(tmpPath, path) != 0)
+            unlink(tmpPath);
+    }
+
+    free(tmpPath);
+    free(path);
+}
+
+/* Build the PIC and/or non-PIC objects from one run of the preprocessor,
+ * filling them from the object cache if we can. Either command may be NULL if
+ * that object isn't wanted. If nonPicFile is NULL, nonPicCmd is only for
+ * preprocessing, so that one PIC object can stand for both when the sources
+ * don't mention PIC. The files the source came from are added to sources, if
+ * we got that far. Returns 1 if we did (exiting on failure), 0 if the objects
+ * must be built from source. */
+static int buildFromPreprocessed(struct Options *opt, int noSuppress,
+                                 struct Buffer *nonPicCmd, char *nonPicFile,
+                                 struct Buffer *picCmd, char *picFile,
+                                 size_t inNamePos, size_t outNamePos,
+                                 char *libsDir, char *outBase,
+                                 struct Buffer *sources)
+{
+    struct Buffer cppCmd, nonPicCppCmd, picCppCmd;
+    struct Buffer *firstCmd = nonPicCmd ? nonPicCmd : picCmd;
+    char nonPicKey[HASH_HEX_SZ], picKey[HASH_HEX_SZ];
+    int nonPicCached = 0, picCached = 0;
+    const char *cppExt;
+    char *cppFile;
+    size_t i;
+    int fail = 0;
+
+    /* splitting out the preprocessor only helps if it's shared, cached, or
+     * we need to know the sources */
+    if (!opt->cacheDir && !opt->skipUnchanged &&
+        !(nonPicCmd && picCmd && opt->preprocessOnce))
+        return 0;
+    if (opt->dryRun ||
+        !(cppExt = cppOutputExt(firstCmd->buf[inNamePos])) ||
+        !canPreprocessOnce(firstCmd->buf))
+        return 0;
+
+    ORL(cppFile, malloc, NULL, (strlen(libsDir) + strlen(outBase) + 5));
+    sprintf(cppFile, "%s/%s.%s", libsDir, outBase, cppExt);
+
+    /* preprocess with the non-PIC flags if we're building both */
+    INIT_BUFFER(cppCmd);
+    for (i = 0; firstCmd->buf[i]; i++) {
+        if (i == outNamePos)
+            WRITE_BUFFER(cppCmd, cppFile);
+        else if (strcmp(firstCmd->buf[i], "-c"))
+            WRITE_BUFFER(cppCmd, firstCmd->buf[i]);
+    }
+    WRITE_BUFFER(cppCmd, "-E");
+    WRITE_BUFFER(cppCmd, NULL);
+    spawn(opt, cppCmd.buf);
+    FREE_BUFFER(cppCmd);
+
+    /* if it could have differed for PIC, do it the slow way */
+    if (cppOutputSources(opt, cppFile, sources) != 0 ||
+        (nonPicCmd && picCmd && sourcesMentionPic(sources))) {
+        unlink(cppFile);
+        free(cppFile);
+        return 0;
+    }
+    if (!nonPicFile) nonPicCmd = NULL;
+
+    /* make the commands to compile from the preprocessed output, and check
+     * for them in the cache */
+    if (nonPicCmd) {
+        cppCompileCommand(opt, &nonPicCppCmd, nonPicCmd->buf, inNamePos, cppFile);
+        if (opt->cacheDir) {
+            if (cacheKey(nonPicCppCmd.buf, cppFile, nonPicKey) == 0)
+                nonPicCached = cacheFetch(opt, nonPicKey, nonPicFile);
+            else
+                nonPicKey[0] = '\0';
+        }
+        if (!nonPicCached) unlink(nonPicFile);
+    }
+    if (picCmd) {
+        cppCompileCommand(opt, &picCppCmd, picCmd->buf, inNamePos, cppFile);
+        if (opt->cacheDir) {
+            if (cacheKey(picCppCmd.buf, cppFile, picKey) == 0)
+                picCached = cacheFetch(opt, picKey, picFile);
+            else
+                picKey[0] = '\0';
+        }
+        if (!picCached) unlink(picFile);
+    }
+
+    /* then compile what we must */
+    if (nonPicCmd && !nonPicCached && picCmd && !picCached) {
+        fail = spawnBoth(opt, noSuppress, nonPicCppCmd.buf, nonPicFile,
+                         picCppCmd.buf, picFile);
+    } else if (nonPicCmd && !nonPicCached) {
+        fail = spawnWait(spawnStart(opt, nonPicCppCmd.buf, -1),
+                         nonPicCppCmd.buf);
+    } else if (picCmd && !picCached) {
+        fail = spawnWait(spawnStart(opt, picCppCmd.buf, -1),
+                         picCppCmd.buf);
+    }
+
+    /* and remember what we compiled */
+    if (!fail && opt->cacheDir) {
+        if (nonPicCmd && !nonPicCached && nonPicKey[0])
+            cacheStore(opt, nonPicKey, nonPicFile);
+        if (picCmd && !picCached && picKey[0])
+            cacheStore(opt, picKey, picFile);
+    }
+
+    if (picCmd)
+        FREE_BUFFER(picCppCmd);
+    if (nonPicCmd)
+        FREE_BUFFER(nonPicCppCmd);
+
+    unlink(cppFile);
+    free(cppFile);
+    if (fail)
+        spawnFailed(opt);
+    return 1;
+}
+
+/* Find the dependency file a compile command writes, if any */
+static char *depFileName(char **cmd)
+{
+    size_t i;
+    for (i = 1; cmd[i]; i++) {
+        if (!strcmp(cmd[i], "-MF") && cmd[i+1])
+            return cmd[i+1];
+        else if (!strncmp(cmd[i], "-MF", 3) && cmd[i][3])
+            return cmd[i] + 3;
+    }
+    return NULL;
+}
+
+/* Hash everything about a compile that isn't in its sources. Returns -1 if it
+ * can't be hashed. */
+static int manifestCommandHash(struct Options *opt, int buildNonPic,
+                               int buildPic, char *hex)
+{
+    struct Hash hash;
+    char *cwd;
+    size_t i;
+
+    hashInit(&hash);
+    hashString(&hash, "mlibtool compile manifest 1");
+    if (hashProgram(&hash, opt->cmd[0]) != 0)
+        return -1;
+    for (i = 0; opt->cmd[i]; i++)
+        hashString(&hash, opt->cmd[i]);
+    hashString(&hash, buildNonPic ? "non-pic" : "");
+    hashString(&hash, buildPic ? "pic" : "");
+
+    /* the command's file names are relative to here */
+    if (!(cwd = currentDir()))
+        return -1;
+    hashString(&hash, cwd);
+    free(cwd);
+
+    hashHex(&hash, hex);
+    return 0;
+}
+
+/* Check whether nothing recorded in the manifest of a previous compile has
+ * changed since, and the outputs are still there. Restores the dependency
+ * file if so. */
+static int manifestUpToDate(struct Options *opt, char *manifest,
+                            char *cmdHash, char **outputs,
+                            char *depFile, char *depCopy)
+{
+    FILE *f;
+    char *lbuf;
+    size_t i, lbufsz, lbufused;
+    int upToDate = 0, sawCommand = 0;
+
+    for (i = 0; outputs[i]; i++)
+        if (access(outputs[i], F_OK) != 0) return 0;
+
+    f = fopen(manifest, "r");
+    if (!f) return 0;
+
+    lbufsz = 32;
+    ORL(lbuf, malloc, NULL, (lbufsz));
+
+    upToDate = 1;
+    while (upToDate && fgets(lbuf, lbufsz, f)) {
+        lbufused = strlen(lbuf);
+
+        /* read in the remainder of the line */
+        while (lbuf[lbufused-1] != '\n') {
+            lbufsz *= 2;
+            ORL(lbuf, realloc, NULL, (lbuf, lbufsz));
+            if (!fgets(lbuf + lbufused, lbufsz - lbufused, f)) break;
+            lbufused = strlen(lbuf);
+        }
+        if (lbuf[lbufused-1] == '\n') lbuf[--lbufused] = '\0';
+
+        if (!strncmp(lbuf, "command ", 8)) {
+            sawCommand = 1;
+            if (strcmp(lbuf + 8, cmdHash)) upToDate = 0;
+
+        } else if (!strncmp(lbuf, "source ", 7) &&
+                   lbufused > 7 + HASH_HEX_SZ) {
+            /* source <hash> <name> */
+            struct Hash hash;
+            char hex[HASH_HEX_SZ];
+
+            hashInit(&hash);
+            if (hashFile(&hash, lbuf + 7 + HASH_HEX_SZ) != 0) {
+                upToDate = 0;
+            } else {
+                hashHex(&hash, hex);
+                if (strncmp(lbuf + 7, hex, HASH_HEX_SZ - 1)) upToDate = 0;
+            }
+
+        }
+    }
+
+    free(lbuf);
+    fclose(f);
+    if (!sawCommand) upToDate = 0;
+
+    /* the dependency file is an output too */
+    if (upToDate && depFile) {
+        unlink(depFile);
+        if (copyFile(depCopy, depFile, 0666) != 0) upToDate = 0;
+    }
+
+    return upToDate;
+}
+
+/* Write a manifest of a compile, to check it with later */
+static void manifestWrite(struct Options *opt, char *manifest, char *cmdHash,
+                          struct Buffer *sources, char *depFile, char *depCopy)
+{
+    char *tmpName;
+    char hex[HASH_HEX_SZ];
+    struct Hash hash;
+    FILE *f;
+    size_t i;
+    int fail = 0;
 
-        printf("Unsupported mode options:\n"
-               "\t-dlopen, -dlpreopen, -export-symbols, -export-symbols-regex,\n"
-               "\t-objectlist, -precious-files-regex, -release, -shared,\n"
-               "\t-shrext, -static, -static-libtool-libs, -weak\n"
-               "\n");
+    ORL(tmpName, malloc, NULL, (strlen(manifest) + 4*sizeof(long) + 2));
+    sprintf(tmpName, "%s.%ld", manifest, (long) getpid());
+    f = fopen(tmpName, "w");
+    if (!f) {
+        free(tmpName);
+        return;
+    }
 
-    } else if (mode == MODE_INSTALL) {
-        printf("\t(none)\n\n");
+    fprintf(f, "# mlibtool compile manifest\n"
+               "command %s\n", cmdHash);
+    for (i = 0; i < sources->bufused; i++) {
+        hashInit(&hash);
+        if (strchr(sources->buf[i], '\n') ||
+            hashFile(&hash, sources->buf[i]) != 0) {
+            fail = 1;
+            break;
+        }
+        hashHex(&hash, hex);
+        fprintf(f, "source %s %s\n", hex, sources->buf[i]);
+    }
+    if (fclose(f) != 0) fail = 1;
 
+    /* keep the dependency file, to restore if we skip the compile */
+    if (!fail && depFile) {
+        unlink(depCopy);
+        if (copyFile(depFile, depCopy, 0666) != 0) fail = 1;
     }
 
-    printf("mlibtool is a mini version of libtool for sensible systems. If you're\n"
-        "compiling for Linux or BSD with supported invocation commands,\n"
-        "<target-libtool> will never be called.\n"
-        "\n"
-        "Unrecognized invocations will be redirected to <target-libtool>.\n");
+    if (fail || rename(tmpName, manifest) != 0)
+        unlink(tmpName);
+    free(tmpName);
 }
 
 static void ltcompile(struct Options *opt)
 {
-    struct Buffer outCmd;
+    struct Buffer outCmd, picCmd, sources;
     size_t i;
-    char *ext;
+    char *ext, *writeName;
     FILE *f;
 
     /* options */
     char *outName = NULL;
     char *inName = NULL;
-    size_t outNamePos = 0;
-    int preferPic = 0, preferNonPic = 0;
-    int buildPic = 0, buildNonPic = 0;
+    size_t outNamePos = 0, inNamePos = 0;
+    int preferPic = 0, preferNonPic = 0, noSuppress = 0;
+    int buildPic = 0, buildNonPic = 0, singleObject = 0, objectsReplaced = 1;
 
     /* option derivatives */
     char *outDirC = NULL,
@@ -634,7 +3074,13 @@ static void ltcompile(struct Options *opt)
          *outBaseC = NULL,
          *outBase = NULL,
          *picFile = NULL,
-         *nonPicFile = NULL;
+         *nonPicFile = NULL,
+         *picOut = NULL,
+         *nonPicOut = NULL,
+         *manifest = NULL,
+         *depFile = NULL,
+         *depCopy = NULL;
+    char cmdHash[HASH_HEX_SZ];
 
     /* allocate the output command */
     INIT_BUFFER(outCmd);
@@ -666,7 +3112,7 @@ static void ltcompile(struct Options *opt)
                 WRITE_BUFFER(outCmd, arg + 4);
 
             } else if (!strcmp(arg, "-no-suppress")) {
-                /* ignored for compatibility */
+                noSuppress = 1;
 
             } else {
                 WRITE_BUFFER(outCmd, arg);
@@ -675,6 +3121,7 @@ static void ltcompile(struct Options *opt)
 
         } else {
             inName = arg;
+            inNamePos = outCmd.bufused;
             WRITE_BUFFER(outCmd, arg);
 
         }
@@ -699,6 +3146,15 @@ static void ltcompile(struct Options *opt)
     else if (!preferPic)
         buildNonPic = opt->buildStatic;
 
+    /* if the compiler builds PIE by default, the non-PIC object is barely
+     * different from the PIC one, so just build the PIC one and link it, if
+     * the sources turn out not to mention PIC */
+    if (buildPic && buildNonPic && !preferNonPic &&
+        (opt->singleObject == 2 || (opt->singleObject && opt->defaultPie))) {
+        buildNonPic = 0;
+        singleObject = 1;
+    }
+
     /* if we don't have an output name, guess */
     if (!outName) {
         /* + 4: .lo\0 */
@@ -750,35 +3206,126 @@ static void ltcompile(struct Options *opt)
     ORL(nonPicFile, malloc, NULL, (strlen(outDir) + strlen(outBase) + 4));
     sprintf(nonPicFile, "%s/%s.o", outDir, outBase);
 
-    /* now do the actual building */
-    if (buildNonPic) {
-        outCmd.buf[outNamePos] = nonPicFile;
-        WRITE_BUFFER(outCmd, NULL);
-        spawn(opt, outCmd.buf);
-        outCmd.bufused--;
+    /* to keep unchanged objects, build them under temporary names first */
+    picOut = picFile;
+    nonPicOut = nonPicFile;
+    if (opt->keepUnchanged && !opt->dryRun &&
+        !outputNameMatters(outCmd.buf, outCmd.bufused)) {
+        picOut = tmpOutputName(opt, picFile);
+        nonPicOut = tmpOutputName(opt, nonPicFile);
+    }
 
-        if (!buildPic && !opt->dryRun)
-            link(nonPicFile, picFile);
+    /* the PIC command is the same, plus PIC flags */
+    if (buildPic) {
+        INIT_BUFFER(picCmd);
+        for (i = 0; i < outCmd.bufused; i++)
+            WRITE_BUFFER(picCmd, outCmd.buf[i]);
+        WRITE_BUFFER(picCmd, "-fPIC");
+        WRITE_BUFFER(picCmd, "-DPIC");
+        picCmd.buf[outNamePos] = picOut;
+        WRITE_BUFFER(picCmd, NULL);
+    }
+    outCmd.buf[outNamePos] = nonPicOut;
+    WRITE_BUFFER(outCmd, NULL);
+
+    /* if nothing has changed since the last compile, we're done */
+    INIT_BUFFER(sources);
+    if (opt->skipUnchanged && !opt->dryRun &&
+        manifestCommandHash(opt, buildNonPic, buildPic, cmdHash) == 0) {
+        char *outputs[4];
+
+        ORL(manifest, malloc, NULL, (strlen(libsDir) + strlen(outBase) + 13));
+        sprintf(manifest, "%s/%s.manifest", libsDir, outBase);
+        if ((depFile = depFileName(outCmd.buf))) {
+            ORL(depCopy, malloc, NULL, (strlen(manifest) + 3));
+            sprintf(depCopy, "%s.d", manifest);
+        }
+
+        outputs[0] = outName;
+        outputs[1] = nonPicFile;
+        outputs[2] = picFile;
+        outputs[3] = NULL;
+        if (manifestUpToDate(opt, manifest, cmdHash, outputs,
+                             depFile, depCopy)) {
+            if (!opt->quiet)
+                fprintf(stderr, "mlibtool: %s is up to date\n", outName);
+            if (nonPicOut != nonPicFile) {
+                free(nonPicOut);
+                free(picOut);
+            }
+            goto done;
+        }
 
+        /* the old manifest is wrong as soon as we touch the outputs */
+        unlink(manifest);
     }
 
-    if (buildPic) {
-        WRITE_BUFFER(outCmd, "-fPIC");
-        WRITE_BUFFER(outCmd, "-DPIC");
-        outCmd.buf[outNamePos] = picFile;
+    /* now do the actual building */
+    if (buildNonPic && buildPic) {
+        if (!buildFromPreprocessed(opt, noSuppress, &outCmd, nonPicOut,
+                                   &picCmd, picOut, inNamePos, outNamePos,
+                                   libsDir, outBase, &sources) &&
+            spawnBoth(opt, noSuppress, outCmd.buf, nonPicOut,
+                      picCmd.buf, picOut))
+            spawnFailed(opt);
+
+    } else if (buildNonPic) {
+        if (!buildFromPreprocessed(opt, noSuppress, &outCmd, nonPicOut,
+                                   NULL, NULL, inNamePos, outNamePos,
+                                   libsDir, outBase, &sources))
+            spawn(opt, outCmd.buf);
+
+    } else if (singleObject) {
+        /* preprocessed without -DPIC, so that it can be the non-PIC object
+         * too, or if that can't be done, build both after all */
+        if (!buildFromPreprocessed(opt, noSuppress, &outCmd, NULL,
+                                   &picCmd, picOut, inNamePos, outNamePos,
+                                   libsDir, outBase, &sources)) {
+            buildNonPic = 1;
+            if (spawnBoth(opt, noSuppress, outCmd.buf, nonPicOut,
+                          picCmd.buf, picOut))
+                spawnFailed(opt);
+        }
 
-        WRITE_BUFFER(outCmd, NULL);
-        spawn(opt, outCmd.buf);
-        outCmd.bufused--;
+    } else if (buildPic) {
+        if (!buildFromPreprocessed(opt, noSuppress, NULL, NULL,
+                                   &picCmd, picOut, inNamePos, outNamePos,
+                                   libsDir, outBase, &sources))
+            spawn(opt, picCmd.buf);
+
+    }
 
-        if (!buildNonPic && !opt->dryRun)
+    /* put the objects in place */
+    if (nonPicOut != nonPicFile) {
+        objectsReplaced = 0;
+        if (buildNonPic)
+            objectsReplaced |= commitOutput(opt, nonPicOut, nonPicFile);
+        else
+            free(nonPicOut);
+        if (buildPic)
+            objectsReplaced |= commitOutput(opt, picOut, picFile);
+        else
+            free(picOut);
+    }
+
+    /* if we only built one, the other is the same */
+    if (!opt->dryRun) {
+        if (!buildPic) {
+            unlink(picFile);
+            link(nonPicFile, picFile);
+        } else if (!buildNonPic) {
+            unlink(nonPicFile);
             link(picFile, nonPicFile);
+        }
     }
 
-    /* and finally, write the .lo file */
-    f = fopen(outName, "w");
+    /* and finally, write the .lo file. Its text rarely changes, but it's what
+     * make sees, so it's only kept if the objects were too. */
+    writeName = (opt->keepUnchanged && !objectsReplaced) ?
+                tmpOutputName(opt, outName) : outName;
+    f = fopen(writeName, "w");
     if (!f) {
-        perror(outName);
+        perror(writeName);
         exit(1);
     }
     fprintf(f, SANE_HEADER
@@ -787,7 +3334,18 @@ static void ltcompile(struct Options *opt)
                "non_pic_object='%s.o'\n",
                outBase, outBase);
     fclose(f);
-
+    if (writeName != outName)
+        commitOutput(opt, writeName, outName);
+
+    /* remember what it was built from */
+    if (manifest && sources.bufused)
+        manifestWrite(opt, manifest, cmdHash, &sources, depFile, depCopy);
+
+done:
+    for (i = 0; i < sources.bufused; i++) free(sources.buf[i]);
+    FREE_BUFFER(sources);
+    free(depCopy);
+    free(manifest);
     free(nonPicFile);
     free(picFile);
     free(libsDir);
@@ -795,9 +3353,165 @@ static void ltcompile(struct Options *opt)
     free(outDirC);
     free(outName);
 
+    if (buildPic)
+        FREE_BUFFER(picCmd);
     FREE_BUFFER(outCmd);
 }
 
+/* Does this compiler option take the next argument as its value? */
+static int compileArgTakesValue(char *arg)
+{
+    static const char *const valueArgs[] = {
+        "-o", "-MF", "-MT", "-MQ", "-I", "-D", "-U", "-include", "-imacros",
+        "-isystem", "-iquote", "-idirafter", "-iprefix", "-iwithprefix",
+        "-iwithprefixbefore", "-isysroot", "-x", "-Xpreprocessor",
+        "-Xassembler", "-Xclang", "-aux-info", "-arch", "-target",
+        "--sysroot", NULL
+    };
+    size_t i;
+    for (i = 0; valueArgs[i]; i++)
+        if (!strcmp(arg, valueArgs[i])) return 1;
+    return 0;
+}
+
+/* Compile several files given in one command, each in its own child, as many
+ * at once as make's jobserver or opt->jobs allow. Only the unambiguous form,
+ * with each source followed by its own -o of a .lo, is taken; for anything
+ * else (including one source) this returns 0, so it's up to the caller. If
+ * the system isn't sane, each file goes to libtool separately, as libtool
+ * only compiles one at a time. */
+static int ltcompileBatch(struct Options *opt, int sane)
+{
+    struct Buffer inputs, outputs, common, fileCmd, fileArgv;
+    size_t i, next, fileArgc;
+    int running = 0, jobs = 0, failed = 0, tmpi;
+    pid_t pid, *pids;
+
+    /* find the input files and their outputs */
+    INIT_BUFFER(inputs);
+    INIT_BUFFER(outputs);
+    INIT_BUFFER(common);
+    WRITE_BUFFER(common, opt->cmd[0]);
+    for (i = 1; opt->cmd[i]; i++) {
+        char *arg = opt->cmd[i];
+        if (arg[0] != '-') {
+            char *out = opt->cmd[i+1] && !strcmp(opt->cmd[i+1], "-o") ?
+                        opt->cmd[i+2] : NULL;
+            char *ext = out ? strrchr(out, '.') : NULL;
+            if (!ext || strcmp(ext, ".lo")) {
+                /* not a source with its own output */
+                inputs.bufused = 0;
+                break;
+            }
+            WRITE_BUFFER(inputs, arg);
+            WRITE_BUFFER(outputs, out);
+            i += 2;
+        } else if (!strcmp(arg, "-o") ||
+                   !strncmp(arg, "-MF", 3) || !strncmp(arg, "-MT", 3) ||
+                   !strncmp(arg, "-MQ", 3)) {
+            /* an output not after its source, or one every file would
+             * share */
+            inputs.bufused = 0;
+            break;
+        } else {
+            WRITE_BUFFER(common, arg);
+            if (compileArgTakesValue(arg) && opt->cmd[i+1])
+                WRITE_BUFFER(common, opt->cmd[++i]);
+        }
+    }
+
+    if (inputs.bufused < 2) {
+        FREE_BUFFER(common);
+        FREE_BUFFER(outputs);
+        FREE_BUFFER(inputs);
+        return 0;
+    }
+
+    /* each child is traced as its own invocation */
+    traceInvocation(NULL, NULL);
+
+    /* each file gets the libtool arguments, the common command, -o and the
+     * file itself */
+    fileArgc = opt->cmd - opt->argv;
+    INIT_BUFFER(fileArgv);
+    for (i = 0; i < fileArgc; i++)
+        WRITE_BUFFER(fileArgv, opt->argv[i]);
+    INIT_BUFFER(fileCmd);
+    for (i = 0; i < common.bufused; i++)
+        WRITE_BUFFER(fileCmd, common.buf[i]);
+
+    ORL(pids, calloc, NULL, (inputs.bufused, sizeof(pid_t)));
+    next = 0;
+    while (next < inputs.bufused || running) {
+        /* start as many as we can: the first with our own job, the rest with
+         * any more we can get */
+        while (next < inputs.bufused &&
+               (running == 0 ||
+                ((!opt->jobs || running < opt->jobs) && jobTake(opt)))) {
+            if (running) jobs++;
+            fileArgv.bufused = fileArgc;
+            fileCmd.bufused = common.bufused;
+            WRITE_BUFFER(fileCmd, inputs.buf[next]);
+            WRITE_BUFFER(fileCmd, "-o");
+            WRITE_BUFFER(fileCmd, outputs.buf[next]);
+            for (i = 0; i < fileCmd.bufused; i++)
+                WRITE_BUFFER(fileArgv, fileCmd.buf[i]);
+            WRITE_BUFFER(fileArgv, NULL);
+
+            fflush(stdout);
+            fflush(stderr);
+            ORX(pid, fork, -1, ());
+            if (pid == 0) {
+                /* the jobs we've taken are still ours, not the child's */
+                jobserver.held = jobserver.local = 0;
+                opt->jobs = 1;
+                opt->argc = fileArgv.bufused - 1;
+                opt->argv = fileArgv.buf;
+                opt->cmd = fileArgv.buf + fileArgc;
+                trace.pid = getpid();
+                trace.start = traceNow();
+                traceInvocation("compile", opt->cmd);
+                if (!sane)
+                    execLibtool(opt);
+                ltcompile(opt);
+                fflush(stdout);
+                exit(0);
+            }
+            pids[next++] = pid;
+            running++;
+        }
+
+        /* then wait for one */
+        pid = waitpid(-1, &tmpi, 0);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            perror("mlibtool: waitpid");
+            exit(1);
+        }
+        for (i = 0; i < next && pids[i] != pid; i++);
+        if (i == next) continue;
+        running--;
+        if (jobs) {
+            jobGive();
+            jobs--;
+        }
+        if (tmpi != 0) {
+            fprintf(stderr, "mlibtool: failed to compile %s\n", inputs.buf[i]);
+            failed = 1;
+        }
+    }
+
+    free(pids);
+    FREE_BUFFER(fileCmd);
+    FREE_BUFFER(fileArgv);
+    FREE_BUFFER(common);
+    FREE_BUFFER(outputs);
+    FREE_BUFFER(inputs);
+
+    if (failed) exit(1);
+    return 1;
+}
+
 /* add a canonicalized library dir to the list */
 static void addLibDir(struct Options *opt,
                       struct Buffer *libDirs,
@@ -805,147 +3519,992 @@ static void addLibDir(struct Options *opt,
                       char *dir)
 {
     char *libDir;
-    if ((libDir = realpath(dir, NULL))) {
-        WRITE_BUFFER(*libDirs, libDir);
+    size_t i;
+    if (!(libDir = realpath(dir, NULL)))
+        libDir = dir;
+
+    /* only once */
+    for (i = 0; i < libDirs->bufused; i++) {
+        if (!strcmp(libDirs->buf[i], libDir)) {
+            if (libDir != dir) free(libDir);
+            return;
+        }
+    }
+
+    WRITE_BUFFER(*libDirs, libDir);
+    if (libDir != dir)
         WRITE_BUFFER(*tofree, libDir);
+}
+
+/* Read the value of a variable from a .la file (allocates), or NULL if it's
+ * not there */
+static char *laField(struct Options *opt, FILE *f, const char *name)
+{
+    char *lbuf, *ret = NULL;
+    size_t lbufsz, lbufused, nameLen = strlen(name);
+
+    rewind(f);
+    lbufsz = 32;
+    ORL(lbuf, malloc, NULL, (lbufsz));
+
+    while (fgets(lbuf, lbufsz, f)) {
+        lbufused = strlen(lbuf);
+
+        /* read in the remainder of the line */
+        while (lbuf[lbufused-1] != '\n') {
+            lbufsz *= 2;
+            ORL(lbuf, realloc, NULL, (lbuf, lbufsz));
+            if (!fgets(lbuf + lbufused, lbufsz - lbufused, f)) break;
+            lbufused = strlen(lbuf);
+        }
+
+        /* is this the line we're looking for? */
+        if (!strncmp(lbuf, name, nameLen) && lbuf[nameLen] == '=' &&
+            lbuf[nameLen+1] == '\'') {
+            char *end = strrchr(lbuf + nameLen + 2, '\'');
+            if (end) *end = '\0';
+            ORL(ret, strdup, NULL, (lbuf + nameLen + 2));
+            break;
+        }
+    }
+
+    free(lbuf);
+    return ret;
+}
+
+/* is this argument a .la file? */
+static int isLaFile(const char *arg)
+{
+    const char *ext = strrchr(arg, '.');
+    return ext && !strcmp(ext, ".la");
+}
+
+/* a .la file in the dependency graph, read only once however many libraries
+ * depend on it */
+struct LaNode {
+    char *real; /* canonical path, by which it's found */
+    char *lflag, *lflagDir; /* -L<dir>/.libs and -l<name> */
+    char *soFile; /* <dir>/.libs/<name>.so */
+    char *deps, *objs;
+    struct Buffer parts; /* dependency_libs, split */
+    struct Buffer extras; /* non-.la dependencies to link after it */
+    int wholeArchive;
+    int closed; /* dependency_libs is a complete, up-to-date closure */
+    int state; /* 0 unvisited, 1 being visited, 2 done */
+    size_t arg; /* the last .la argument that needs it */
+    struct LaNode *next; /* in its hash bucket */
+};
+
+#define LA_BUCKETS 256
+
+struct LaGraph {
+    struct LaNode *buckets[LA_BUCKETS];
+
+    /* visited libraries, each after everything it depends on */
+    struct LaNode **order;
+    size_t orderUsed, orderSz;
+};
+
+/* what a .la file in a stored closure looked like, to tell if it's changed
+ * since. Returns -1 if it can't be found. */
+static int laStamp(const char *name, char *buf)
+{
+    struct stat sbuf;
+    if (stat(name, &sbuf) != 0) return -1;
+    sprintf(buf, "%lx.%lu.%ld.%ld", (unsigned long) sbuf.st_ino,
+            (unsigned long) sbuf.st_size, (long) sbuf.st_mtime,
+            MTIME_NSEC(sbuf));
+    return 0;
+}
+
+/* find a .la file in the graph, or make a node for it. Its dependencies are
+ * only read if readDeps is set. Everything allocated goes in tofree. */
+static struct LaNode *laNode(struct Options *opt,
+                             struct LaGraph *graph,
+                             int buildLib,
+                             int readDeps,
+                             struct Buffer *tofree,
+                             char *arg)
+{
+    struct LaNode *node;
+    struct Hash hash;
+    size_t bucket;
+    char *real, *laDirC, *laDir, *laBaseC, *laBase, *ext;
+    char *closure = NULL;
+    double start;
+    FILE *f;
+
+    /* the same library is usually reached by several paths */
+    if (!(real = realpath(arg, NULL)))
+        ORL(real, strdup, NULL, (arg));
+    hashInit(&hash);
+    hashString(&hash, real);
+    bucket = hash.lo % LA_BUCKETS;
+    for (node = graph->buckets[bucket]; node; node = node->next) {
+        if (!strcmp(node->real, real)) {
+            free(real);
+            return node;
+        }
+    }
+
+    ORL(node, calloc, NULL, (1, sizeof(struct LaNode)));
+    WRITE_BUFFER(*tofree, (char *) node);
+    WRITE_BUFFER(*tofree, real);
+    node->real = real;
+    INIT_BUFFER(node->parts);
+    INIT_BUFFER(node->extras);
+    node->next = graph->buckets[bucket];
+    graph->buckets[bucket] = node;
+
+    /* figure out the .libs name */
+    ORL(laDirC, strdup, NULL, (arg));
+    laDir = dirname(laDirC);
+    ORL(laBaseC, strdup, NULL, (arg));
+    laBase = basename(laBaseC);
+
+    /* get the -l name */
+    ext = strrchr(laBase, '.');
+    if (ext) *ext = '\0';
+
+    /* if there's only a .a, libtool specifies we bring in the whole archive */
+    ORL(node->soFile, malloc, NULL, (strlen(laDir) + strlen(laBase) + 11));
+    sprintf(node->soFile, "%s/.libs/%s.so", laDir, laBase);
+    WRITE_BUFFER(*tofree, node->soFile);
+    if (buildLib && access(node->soFile, F_OK) != 0)
+        node->wholeArchive = 1;
+
+    ORL(node->lflagDir, malloc, NULL, (strlen(laDir) + 9));
+    sprintf(node->lflagDir, "-L%s/.libs", laDir);
+    WRITE_BUFFER(*tofree, node->lflagDir);
+
+    if (!strncmp(laBase, "lib", 3)) laBase += 3;
+    ORL(node->lflag, malloc, NULL, (strlen(laBase) + 3));
+    sprintf(node->lflag, "-l%s", laBase);
+    WRITE_BUFFER(*tofree, node->lflag);
+
+    free(laBaseC);
+    free(laDirC);
+
+    if (!readDeps && !node->wholeArchive)
+        return node;
+
+    start = traceNow();
+    f = fopen(arg, "r");
+    if (f) {
+        if (readDeps) {
+            node->deps = laField(opt, f, "dependency_libs");
+            closure = laField(opt, f, "mlibtool_closure");
+        }
+        if (node->wholeArchive)
+            node->objs = laField(opt, f, "mlibtool_objects");
+        fclose(f);
+    }
+    if (node->objs)
+        WRITE_BUFFER(*tofree, node->objs);
+
+    /* split up the dependencies for visiting */
+    if (node->deps) {
+        char *part, *saveptr;
+        for (part = strtok_r(node->deps, " ", &saveptr); part;
+             part = strtok_r(NULL, " ", &saveptr))
+            WRITE_BUFFER(node->parts, part);
+        WRITE_BUFFER(*tofree, node->deps);
+    }
+
+    /* if it stored its closure, and none of the .la files in it have
+     * changed since, we needn't read them */
+    if (closure) {
+        char *stamp, *saveptr, buf[128];
+        size_t i;
+
+        stamp = strtok_r(closure, " ", &saveptr);
+        node->closed = 1;
+        for (i = 0; i < node->parts.bufused && node->closed; i++) {
+            if (!isLaFile(node->parts.buf[i])) continue;
+            if (!stamp || laStamp(node->parts.buf[i], buf) != 0 ||
+                strcmp(stamp, buf))
+                node->closed = 0;
+            stamp = strtok_r(NULL, " ", &saveptr);
+        }
+        if (stamp) node->closed = 0;
+
+        free(closure);
+    }
+
+    traceEvent("la", real, start, traceNow() - start,
+               node->closed ? "\"closed\":1" : "\"closed\":0");
+    return node;
+}
+
+/* add a node to the order, now that everything it depends on is there */
+static void laVisited(struct Options *opt,
+                      struct LaGraph *graph,
+                      struct LaNode *node)
+{
+    node->state = 2;
+    while (graph->orderUsed >= graph->orderSz) {
+        graph->orderSz = graph->orderSz ? graph->orderSz * 2 : 32;
+        ORL(graph->order, realloc, NULL,
+            (graph->order, graph->orderSz * sizeof(struct LaNode *)));
+    }
+    graph->order[graph->orderUsed++] = node;
+}
+
+/* visit everything a library depends on, then the library. The dependencies
+ * are visited last to first, so that reversing the order keeps them in their
+ * original order wherever that's possible. */
+static void laVisit(struct Options *opt,
+                    struct LaGraph *graph,
+                    int buildLib,
+                    struct Buffer *tofree,
+                    struct LaNode *node)
+{
+    size_t i;
+
+    node->state = 1;
+
+    if (node->closed) {
+        /* its dependencies are already in order, so take them as they are,
+         * each followed by the non-.la dependencies that follow it */
+        struct LaNode *prev = node;
+        struct Buffer fresh;
+
+        INIT_BUFFER(fresh);
+        for (i = 0; i < node->parts.bufused; i++) {
+            char *part = node->parts.buf[i];
+            if (isLaFile(part)) {
+                prev = laNode(opt, graph, buildLib, 0, tofree, part);
+                if (prev->state == 0) {
+                    prev->state = 1;
+                    WRITE_BUFFER(fresh, (char *) prev);
+                }
+            } else {
+                WRITE_BUFFER(prev->extras, part);
+            }
+        }
+
+        for (i = fresh.bufused; i > 0; i--)
+            laVisited(opt, graph, (struct LaNode *) fresh.buf[i-1]);
+        FREE_BUFFER(fresh);
+
     } else {
-        WRITE_BUFFER(*libDirs, dir);
+        for (i = node->parts.bufused; i > 0; i--) {
+            char *part = node->parts.buf[i-1];
+            if (isLaFile(part)) {
+                struct LaNode *dep = laNode(opt, graph, buildLib, 1, tofree,
+                                            part);
+                /* a dependency being visited is a cycle, so just ignore it */
+                if (dep->state == 0)
+                    laVisit(opt, graph, buildLib, tofree, dep);
+            } else {
+                WRITE_BUFFER(node->extras, part);
+            }
+        }
+
+        /* those were backwards */
+        for (i = 0; i < node->extras.bufused / 2; i++) {
+            char *tmp = node->extras.buf[i];
+            node->extras.buf[i] = node->extras.buf[node->extras.bufused-i-1];
+            node->extras.buf[node->extras.bufused-i-1] = tmp;
+        }
+
+    }
+
+    laVisited(opt, graph, node);
+}
+
+/* save what the .la files in a closure look like, to be checked by laNode */
+static void writeClosure(struct Options *opt,
+                         FILE *f,
+                         struct Buffer *dependencyLibs)
+{
+    struct Buffer stamps;
+    char buf[128], *stamp;
+    size_t i;
+
+    INIT_BUFFER(stamps);
+    for (i = 0; i < dependencyLibs->bufused; i++) {
+        if (!isLaFile(dependencyLibs->buf[i])) continue;
+        if (laStamp(dependencyLibs->buf[i], buf) != 0) break;
+        ORL(stamp, strdup, NULL, (buf));
+        WRITE_BUFFER(stamps, stamp);
+    }
+
+    /* if any are missing, it'll have to be walked anyway */
+    if (i == dependencyLibs->bufused) {
+        fprintf(f, "mlibtool_closure='");
+        for (i = 0; i < stamps.bufused; i++)
+            fprintf(f, " %s", stamps.buf[i]);
+        fprintf(f, "'\n");
+    }
+
+    for (i = 0; i < stamps.bufused; i++) free(stamps.buf[i]);
+    FREE_BUFFER(stamps);
+}
+
+/* remove repeated libraries, keeping the first -L (so the search order is
+ * unchanged) and the last -l or .la (so each library still comes after
+ * everything that needs it). Anything else, such as position-sensitive -Wl
+ * flags, whole archives and NULL separators, is left where it is. */
+static void dedupLibs(struct Buffer *libs)
+{
+    size_t i, j, out = 0;
+    int whole = 0;
+
+    for (i = 0; i < libs->bufused; i++) {
+        char *arg = libs->buf[i];
+        int keep = 1;
+
+        if (!arg) {
+            /* keep */
+
+        } else if (!strcmp(arg, "-Wl,--whole-archive")) {
+            whole = 1;
+
+        } else if (!strcmp(arg, "-Wl,--no-whole-archive")) {
+            whole = 0;
+
+        } else if (whole) {
+            /* keep */
+
+        } else if (!strncmp(arg, "-L", 2)) {
+            for (j = 0; j < out && keep; j++)
+                if (libs->buf[j] && !strcmp(libs->buf[j], arg)) keep = 0;
+
+        } else if (!strncmp(arg, "-l", 2) || isLaFile(arg)) {
+            for (j = i + 1; j < libs->bufused && keep; j++)
+                if (libs->buf[j] && !strcmp(libs->buf[j], arg)) keep = 0;
+
+        }
+
+        if (keep)
+            libs->buf[out++] = arg;
+    }
+
+    libs->bufused = out;
+}
+
+/* the most complicated part of linking is linking in .la files. The whole
+ * closure of libraries is worked out at once, so that each is linked once,
+ * before everything it depends on and where the last .la argument that needs
+ * it was. outLibs gets what goes at each argument in turn, separated by
+ * NULLs. */
+static void linkLaFiles(struct Options *opt,
+                        int buildLib,
+                        struct Buffer *laFiles,
+                        struct Buffer *outLibs,
+                        struct Buffer *libDirs,
+                        struct Buffer *soFiles,
+                        struct Buffer *dependencyLibs,
+                        struct Buffer *objects,
+                        struct Buffer *tofree)
+{
+    struct LaGraph graph;
+    size_t i, j, arg;
+
+    /* visiting the arguments last to first, anything reached is first
+     * reached from the last argument that needs it */
+    memset(&graph, 0, sizeof(graph));
+    for (i = laFiles->bufused; i > 0; i--) {
+        struct LaNode *node = laNode(opt, &graph, buildLib, 1, tofree,
+                                     laFiles->buf[i-1]);
+        j = graph.orderUsed;
+        if (node->state == 0)
+            laVisit(opt, &graph, buildLib, tofree, node);
+        for (; j < graph.orderUsed; j++)
+            graph.order[j]->arg = i - 1;
+    }
+
+    arg = 0;
+    for (i = graph.orderUsed; i > 0; i--) {
+        struct LaNode *node = graph.order[i-1];
+
+        for (; arg < node->arg; arg++)
+            WRITE_BUFFER(*outLibs, NULL);
+
+        if (node->objs) {
+            /* if we know what's in a convenience library, we can just link
+             * those */
+            char *part, *saveptr;
+            for (part = strtok_r(node->objs, " ", &saveptr); part;
+                 part = strtok_r(NULL, " ", &saveptr)) {
+                WRITE_BUFFER(*outLibs, part);
+                WRITE_BUFFER(*objects, part);
+            }
+
+        } else {
+            /* add -L for the .libs path */
+            WRITE_BUFFER(*outLibs, node->lflagDir);
+            addLibDir(opt, libDirs, tofree, node->lflagDir + 2);
+
+            if (node->wholeArchive) {
+                /* this is GNU-ld-specific, so retry if it doesn't work,
+                 * unless the profile says whether it does */
+                if (opt->wholeArchive == 0)
+                    execLibtool(opt);
+                else if (opt->wholeArchive < 0)
+                    opt->retryIfFail = 1;
+                WRITE_BUFFER(*outLibs, "-Wl,--whole-archive");
+                WRITE_BUFFER(*outLibs, node->lflag);
+                WRITE_BUFFER(*outLibs, "-Wl,--no-whole-archive");
+
+            } else {
+                /* if we're not linking in the whole archive, then this
+                 * becomes a dependency */
+                WRITE_BUFFER(*dependencyLibs, node->real);
+                WRITE_BUFFER(*outLibs, node->lflag);
+                WRITE_BUFFER(*soFiles, node->soFile);
+
+            }
+
+        }
+
+        /* then anything else it depends on */
+        for (j = 0; j < node->extras.bufused; j++) {
+            WRITE_BUFFER(*outLibs, node->extras.buf[j]);
+            WRITE_BUFFER(*dependencyLibs, node->extras.buf[j]);
+        }
+    }
+    for (; arg + 1 < laFiles->bufused; arg++)
+        WRITE_BUFFER(*outLibs, NULL);
+
+    dedupLibs(outLibs);
+
+    for (i = 0; i < graph.orderUsed; i++) {
+        FREE_BUFFER(graph.order[i]->parts);
+        FREE_BUFFER(graph.order[i]->extras);
+    }
+    free(graph.order);
+}
+
+/* symbols for an archive's index, and which member each is in */
+struct ArSymbols {
+    char *names;
+    size_t namesUsed, namesSz;
+    size_t *members;
+    size_t count, sz;
+};
+
+/* read ELF fields of either byte order */
+static uint64_t elfRead(const unsigned char *p, int size, int bigEndian)
+{
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < size; i++)
+        v |= (uint64_t) p[bigEndian ? i : size - 1 - i] << (8 * (size - 1 - i));
+    return v;
+}
+
+/* Add the symbols an ELF object defines to an archive index. Returns -1 if
+ * it's not an ELF object we can index, including LTO objects, which need the
+ * linker plugin. */
+static int elfSymbols(const unsigned char *data, size_t size, size_t member,
+                      struct ArSymbols *syms)
+{
+    int is64, be;
+    uint64_t shoff, shentsize, shnum, shstrndx;
+    uint64_t symOff = 0, symSize = 0, symEnt = 0, strOff = 0, strSize = 0;
+    uint64_t i;
+    const unsigned char *sh, *shstr;
+    uint64_t shstrOff, shstrSize;
+
+#define RD(p, sz) elfRead((p), (sz), be)
+#define SH(i) (data + shoff + (i) * shentsize)
+#define SH_NAME(s) RD((s), 4)
+#define SH_TYPE(s) RD((s) + 4, 4)
+#define SH_OFFSET(s) (is64 ? RD((s) + 24, 8) : RD((s) + 16, 4))
+#define SH_SIZE(s) (is64 ? RD((s) + 32, 8) : RD((s) + 20, 4))
+#define SH_LINK(s) (is64 ? RD((s) + 40, 4) : RD((s) + 24, 4))
+#define SH_ENTSIZE(s) (is64 ? RD((s) + 56, 8) : RD((s) + 36, 4))
+
+    if (size < 64 || memcmp(data, "\177ELF", 4) != 0)
+        return -1;
+    if (data[4] != 1 && data[4] != 2) return -1;
+    if (data[5] != 1 && data[5] != 2) return -1;
+    is64 = (data[4] == 2);
+    be = (data[5] == 2);
+
+    shoff = is64 ? RD(data + 40, 8) : RD(data + 32, 4);
+    shentsize = RD(data + (is64 ? 58 : 46), 2);
+    shnum = RD(data + (is64 ? 60 : 48), 2);
+    shstrndx = RD(data + (is64 ? 62 : 50), 2);
+    if (shoff == 0) return 0; /* no sections, no symbols */
+    if (shentsize < (is64 ? 64 : 40) || shoff > size ||
+        shentsize > size - shoff)
+        return -1;
+
+    /* very many sections are counted in the first section header */
+    if (shnum == 0) shnum = SH_SIZE(SH(0));
+    if (shstrndx == 0xffff) shstrndx = SH_LINK(SH(0));
+    if (shnum > (size - shoff) / shentsize || shstrndx >= shnum)
+        return -1;
+
+    shstr = SH(shstrndx);
+    shstrOff = SH_OFFSET(shstr);
+    shstrSize = SH_SIZE(shstr);
+    if (shstrOff > size || shstrSize > size - shstrOff)
+        return -1;
+
+    /* find the symbol table, and make sure this isn't LTO */
+    for (i = 0; i < shnum; i++) {
+        uint64_t name;
+        sh = SH(i);
+        name = SH_NAME(sh);
+        if (name < shstrSize &&
+            !strncmp((const char *) data + shstrOff + name, ".gnu.lto_", 9))
+            return -1;
+
+        if (SH_TYPE(sh) == 2 /* SHT_SYMTAB */) {
+            uint64_t link = SH_LINK(sh);
+            symOff = SH_OFFSET(sh);
+            symSize = SH_SIZE(sh);
+            symEnt = SH_ENTSIZE(sh);
+            if (link >= shnum) return -1;
+            strOff = SH_OFFSET(SH(link));
+            strSize = SH_SIZE(SH(link));
+        }
+    }
+    if (!symSize) return 0;
+    if (symEnt < (uint64_t) (is64 ? 24 : 16) || symOff > size ||
+        symSize > size - symOff || strOff > size || strSize > size - strOff)
+        return -1;
+
+    /* and take every defined global symbol */
+    for (i = symEnt; i + symEnt <= symSize; i += symEnt) {
+        const unsigned char *sym = data + symOff + i;
+        uint64_t name = RD(sym, 4);
+        int bind = (is64 ? sym[4] : sym[12]) >> 4;
+        uint64_t shndx = RD(sym + (is64 ? 6 : 14), 2);
+        const char *nameS;
+        size_t len;
+
+        if (bind != 1 /* GLOBAL */ && bind != 2 /* WEAK */ &&
+            bind != 10 /* GNU_UNIQUE */)
+            continue;
+        if (shndx == 0 /* UNDEF */ || name >= strSize)
+            continue;
+
+        nameS = (const char *) data + strOff + name;
+        if (!memchr(nameS, '\0', strSize - name)) return -1;
+        len = strlen(nameS);
+        if (!strcmp(nameS, "__gnu_lto_slim")) return -1;
+
+        while (syms->namesUsed + len + 1 > syms->namesSz) {
+            syms->namesSz *= 2;
+            ORX(syms->names, realloc, NULL, (syms->names, syms->namesSz));
+        }
+        memcpy(syms->names + syms->namesUsed, nameS, len + 1);
+        syms->namesUsed += len + 1;
+
+        if (syms->count >= syms->sz) {
+            syms->sz *= 2;
+            ORX(syms->members, realloc, NULL,
+                (syms->members, syms->sz * sizeof(size_t)));
+        }
+        syms->members[syms->count++] = member;
     }
+
+#undef SH_ENTSIZE
+#undef SH_LINK
+#undef SH_SIZE
+#undef SH_OFFSET
+#undef SH_TYPE
+#undef SH_NAME
+#undef SH
+#undef RD
+    return 0;
+}
+
+/* Write an ar member header */
+static void arHeader(FILE *f, const char *name, const char *date,
+                     const char *mode, uint64_t size)
+{
+    fprintf(f, "%-16s%-12s%-6s%-6s%-8s%-10lu`\n",
+            name, date, date[0] ? "0" : "", date[0] ? "0" : "", mode,
+            (unsigned long) size);
+}
+
+/* Get the path to a file relative to a directory, as a thin archive refers
+ * to its members (allocates) */
+static char *relativePath(struct Options *opt, char *dir, char *file)
+{
+    char *realDir, *fileDirC, *fileBaseC, *realFileDir, *ret, *d, *f;
+    size_t i, up = 0, common;
+
+    ORL(fileDirC, strdup, NULL, (file));
+    ORL(fileBaseC, strdup, NULL, (file));
+    realDir = realpath(dir, NULL);
+    realFileDir = realpath(dirname(fileDirC), NULL);
+    if (!realDir || !realFileDir) {
+        free(realDir);
+        free(realFileDir);
+        free(fileBaseC);
+        free(fileDirC);
+        return NULL;
+    }
+
+    /* find the common directory, the longest shared prefix that ends at a /
+     * or the end in both (with / itself as the empty string) */
+    if (!strcmp(realDir, "/")) realDir[0] = '\0';
+    if (!strcmp(realFileDir, "/")) realFileDir[0] = '\0';
+    for (i = 0, common = 0; ; i++) {
+        char a = realDir[i], b = realFileDir[i];
+        if ((a == '/' || !a) && (b == '/' || !b)) common = i;
+        if (a != b || !a) break;
+    }
+
+    /* go up from dir to there */
+    for (d = realDir + common; *d; d++)
+        if (*d == '/') up++;
+    f = realFileDir + common;
+    if (*f == '/') f++;
+
+    ORL(ret, malloc, NULL, (3 * up + strlen(f) + strlen(file) + 3));
+    ret[0] = '\0';
+    while (up--) strcat(ret, "../");
+    if (*f) {
+        strcat(ret, f);
+        strcat(ret, "/");
+    }
+    strcat(ret, basename(fileBaseC));
+
+    free(realDir);
+    free(realFileDir);
+    free(fileBaseC);
+    free(fileDirC);
+    return ret;
 }
 
-/* the most complicated part of linking is linking in .la files */
-static void linkLaFile(struct Options *opt,
-                       int buildLib,
-                       struct Buffer *outCmd,
-                       struct Buffer *libDirs,
-                       struct Buffer *dependencyLibs,
-                       struct Buffer *tofree,
-                       char *arg)
+/* Write a GNU ar archive with an index, as ar rcD and ranlib -D would (but
+ * always fresh, and keeping members with the same name). A thin archive
+ * (ar rcTD) refers to its members instead of containing them. Returns
+ * nonzero if we can't, for ar to have a go. */
+static int writeArchive(struct Options *opt, char **members, size_t count,
+                        char *path, int thin)
 {
-    /* link to this library */
-    char *laDirC, *laDir, *laBaseC, *laBase, *aarg, *ext;
-    int wholeArchive = 0;
-    FILE *f;
-
-    /* OK, it's a .la file, figure out the .libs name */
-    ORL(laDirC, strdup, NULL, (arg));
-    laDir = dirname(laDirC);
-    ORL(laBaseC, strdup, NULL, (arg));
-    laBase = basename(laBaseC);
+    struct ArSymbols syms;
+    char *longNames = NULL, **names, *arDirC = NULL, *arDir = NULL, *relName = NULL;
+    size_t i, longUsed = 0, longSz = 0, *sizes, *longOffs;
+    uint64_t symtabSize, offset;
+    unsigned char *buf;
+    FILE *f = NULL;
+    int ret = 1, fd;
+
+    ORL(syms.names, malloc, NULL, (syms.namesSz = 1024));
+    syms.namesUsed = 0;
+    ORL(syms.members, malloc, NULL, ((syms.sz = 256) * sizeof(size_t)));
+    syms.count = 0;
+    ORL(sizes, calloc, NULL, (count + 1, sizeof(size_t)));
+    ORL(longOffs, calloc, NULL, (count + 1, sizeof(size_t)));
+    ORL(names, calloc, NULL, (count + 1, sizeof(char *)));
+    ORL(buf, malloc, NULL, (BUFSIZ));
+
+    /* first read everything's symbols */
+    for (i = 0; i < count; i++) {
+        struct stat sbuf;
+        void *data;
+        int bad;
+
+        if ((fd = open(members[i], O_RDONLY)) < 0 || fstat(fd, &sbuf) != 0) {
+            perror(members[i]);
+            if (fd >= 0) close(fd);
+            goto out;
+        }
+        sizes[i] = sbuf.st_size;
+        if (sbuf.st_size == 0) {
+            close(fd);
+            continue;
+        }
+        data = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) goto out;
+        bad = elfSymbols(data, sbuf.st_size, i, &syms);
+        munmap(data, sbuf.st_size);
+        if (bad) goto out;
+    }
 
-    /* get the -l name */
-    ext = strrchr(laBase, '.');
-    if (ext) *ext = '\0';
+    /* then work out the names, with long ones (and all of them in a thin
+     * archive, as paths from it) in the long name table */
+    if (thin) {
+        ORL(arDirC, strdup, NULL, (path));
+        arDir = dirname(arDirC);
+    }
+    for (i = 0; i < count; i++) {
+        char *base = strrchr(members[i], '/');
+        size_t len;
+        base = base ? base + 1 : members[i];
+        if (thin) {
+            free(relName);
+            if (!(relName = relativePath(opt, arDir, members[i])))
+                goto out;
+            base = relName;
+        }
+        len = strlen(base);
+        ORL(names[i], malloc, NULL, (len + 2 + 4*sizeof(size_t)));
+        if (len < 16 && !thin) {
+            sprintf(names[i], "%s/", base);
+        } else {
+            while (longUsed + len + 3 > longSz) {
+                longSz = longSz ? longSz * 2 : 1024;
+                ORL(longNames, realloc, NULL, (longNames, longSz));
+            }
+            sprintf(names[i], "/%lu", (unsigned long) longUsed);
+            sprintf(longNames + longUsed, "%s/\n", base);
+            longUsed += len + 2;
+        }
+    }
+    if (longUsed & 1) longNames[longUsed++] = '\n';
+
+    /* and where each member will go */
+    symtabSize = 4 + 4 * syms.count + syms.namesUsed;
+    symtabSize += symtabSize & 1;
+    offset = 8 + 60 + symtabSize;
+    if (longUsed) offset += 60 + longUsed;
+    for (i = 0; i < count; i++) {
+        longOffs[i] = offset;
+        offset += 60;
+        if (!thin) offset += sizes[i] + (sizes[i] & 1);
+    }
+    if (offset > 0xffffffffUL) goto out; /* needs a 64-bit index */
 
-    /* add -L for the .libs path */
-    ORL(aarg, malloc, NULL, (strlen(laDir) + 9));
-    sprintf(aarg, "-L%s/.libs", laDir);
-    WRITE_BUFFER(*outCmd, aarg);
-    WRITE_BUFFER(*tofree, aarg);
-    addLibDir(opt, libDirs, tofree, aarg + 2);
+    /* now write it all out */
+    unlink(path);
+    if (!(f = fopen(path, "wb"))) {
+        perror(path);
+        goto out;
+    }
+    fputs(thin ? "!<thin>\n" : "!<arch>\n", f);
+
+    arHeader(f, "/", "0", "0", symtabSize);
+    fputc((int) (syms.count >> 24) & 0xff, f);
+    fputc((int) (syms.count >> 16) & 0xff, f);
+    fputc((int) (syms.count >> 8) & 0xff, f);
+    fputc((int) syms.count & 0xff, f);
+    for (i = 0; i < syms.count; i++) {
+        size_t off = longOffs[syms.members[i]];
+        fputc((int) (off >> 24) & 0xff, f);
+        fputc((int) (off >> 16) & 0xff, f);
+        fputc((int) (off >> 8) & 0xff, f);
+        fputc((int) off & 0xff, f);
+    }
+    fwrite(syms.names, 1, syms.namesUsed, f);
+    if (syms.namesUsed & 1) fputc('\0', f);
 
-    /* if there's only a .a, libtool specifies we bring in the whole archive */
-    if (buildLib) {
-        ORL(aarg, malloc, NULL, (strlen(laDir) + strlen(laBase) + 11));
-        sprintf(aarg, "%s/.libs/%s.so", laDir, laBase);
-        if (access(aarg, F_OK) != 0)
-            wholeArchive = 1;
-        free(aarg);
+    if (longUsed) {
+        arHeader(f, "//", "", "", longUsed);
+        fwrite(longNames, 1, longUsed, f);
     }
-    if (wholeArchive) {
-        /* this is GNU-ld-specific, so retry if it doesn't work */
-        opt->retryIfFail = 1;
-        WRITE_BUFFER(*outCmd, "-Wl,--whole-archive");
 
-    } else {
-        /* if we're not linking in the whole archive, then this becomes a
-         * dependency */
-        if (dependencyLibs) {
-            char *realla;
-            if ((realla = realpath(arg, NULL))) {
-                WRITE_BUFFER(*dependencyLibs, realla);
-                WRITE_BUFFER(*tofree, realla);
-            } else {
-                WRITE_BUFFER(*dependencyLibs, arg);
-            }
+    for (i = 0; i < count; i++) {
+        ssize_t rd;
+        size_t total = 0;
+
+        arHeader(f, names[i], "0", "644", sizes[i]);
+        if (thin) continue;
+        if ((fd = open(members[i], O_RDONLY)) < 0) {
+            perror(members[i]);
+            goto out;
+        }
+        while (total < sizes[i] && (rd = read(fd, buf, BUFSIZ)) > 0) {
+            if ((size_t) rd > sizes[i] - total) rd = sizes[i] - total;
+            fwrite(buf, 1, rd, f);
+            total += rd;
         }
+        close(fd);
+        if (total != sizes[i]) {
+            fprintf(stderr, "mlibtool: %s changed while archiving it\n", members[i]);
+            goto out;
+        }
+        if (sizes[i] & 1) fputc('\n', f);
+    }
 
+    ret = 0;
+
+out:
+    if (f && (fclose(f) != 0 || ret)) {
+        if (!ret) perror(path);
+        unlink(path);
+        ret = 1;
     }
+    for (i = 0; i < count; i++) free(names[i]);
+    free(names);
+    free(relName);
+    free(arDirC);
+    free(buf);
+    free(longOffs);
+    free(sizes);
+    free(longNames);
+    free(syms.members);
+    free(syms.names);
+    return ret;
+}
 
-    /* and add -l<lib name> */
-    if (!strncmp(laBase, "lib", 3)) laBase += 3;
-    ORL(aarg, malloc, NULL, (strlen(laBase) + 3));
-    sprintf(aarg, "-l%s", laBase);
-    WRITE_BUFFER(*outCmd, aarg);
-    WRITE_BUFFER(*tofree, aarg);
+/* how a background ltarchive says it kept an identical .a */
+#define AR_KEPT_STATUS 3
+
+/* Build a .a file from the objects in outAr (ar, ranlib and the .a itself
+ * in place 0 to 2), or a thin archive referring to them. Returns 1 if apath
+ * was replaced, 0 if an identical one was kept. */
+static int ltarchive(struct Options *opt, struct Buffer *outAr, char *apath,
+                     int keep, int thin)
+{
+    char *arFlags, *firstMember;
 
-    if (wholeArchive) {
-        WRITE_BUFFER(*outCmd, "-Wl,--no-whole-archive");
+    /* ar adds to an existing archive, so always start a new one if we're
+     * comparing them */
+    outAr->buf[2] = keep ? tmpOutputName(opt, apath) : apath;
+    if (keep) unlink(outAr->buf[2]);
+
+    /* write it ourselves if we can */
+    if (!opt->dryRun) {
+        if (writeArchive(opt, outAr->buf + 3, outAr->bufused - 3,
+                         outAr->buf[2], thin) == 0) {
+            if (!opt->quiet)
+                fprintf(stderr, "mlibtool: wrote %s\n", apath);
+            if (outAr->buf[2] != apath)
+                return commitOutput(opt, outAr->buf[2], apath);
+            return 1;
+        }
+        if (!opt->quiet)
+            fprintf(stderr, "mlibtool: can't write %s, trying ar\n", outAr->buf[2]);
     }
 
-    free(laBaseC);
-    free(laDirC);
+    /* run ar */
+    WRITE_BUFFER(*outAr, NULL);
+    spawn(opt, outAr->buf);
+    outAr->bufused--;
+
+    /* and make sure to ranlib too! */
+    arFlags = outAr->buf[1];
+    firstMember = outAr->buf[3];
+    outAr->buf[1] = "ranlib";
+    outAr->buf[3] = NULL;
+    spawn(opt, outAr->buf + 1);
+    outAr->buf[1] = arFlags;
+    outAr->buf[3] = firstMember;
+
+    if (outAr->buf[2] != apath)
+        return commitOutput(opt, outAr->buf[2], apath);
+    return 1;
+}
 
-    /* then add any dependencies */
-    f = fopen(arg, "r");
-    if (f) {
-        char *lbuf;
-        size_t lbufsz, lbufused;
-        lbufsz = 32;
-        ORL(lbuf, malloc, NULL, (lbufsz));
+/* Link the sonames of the build tree's libraries that a binary needs into one
+ * directory at the top of the build tree, so that its wrapper only needs that
+ * in LD_LIBRARY_PATH, not every .libs directory. The directories that are
+ * covered go in farmed. Returns the directory (in tofree), or NULL if they
+ * can't all go in it, e.g. because two libraries have the same soname. */
+static char *libFarm(struct Options *opt,
+                     struct Buffer *soFiles,
+                     struct Buffer *farmed,
+                     struct Buffer *tofree)
+{
+    char *root, *farm, *libDir, *soDirC, *soBaseC, *soname, *target, *name;
+    char *tmpName, buf[1024];
+    ssize_t len;
+    size_t i;
+    int ok = 1;
+
+    if (opt->dryRun || !(root = buildTreeRoot())) return NULL;
+    ORL(farm, malloc, NULL, (strlen(root) + 16));
+    sprintf(farm, "%s/.mlibtool-libs", root);
+    free(root);
+    WRITE_BUFFER(*tofree, farm);
+    mkdir(farm, 0777); /* ignore errors */
+
+    for (i = 0; i < soFiles->bufused && ok; i++) {
+        char *so = soFiles->buf[i];
+
+        ORL(soDirC, strdup, NULL, (so));
+        ORL(soBaseC, strdup, NULL, (so));
+
+        /* the soname is what the .so links to, less its minor version and
+         * revision, or the .so itself if it's not a link. If there's no .so,
+         * it's a static library, and not needed at run time. */
+        libDir = realpath(dirname(soDirC), NULL);
+        len = readlink(so, buf, sizeof(buf) - 1);
+        if (len >= 0) {
+            char *ver;
+            buf[len] = '\0';
+            soname = strrchr(buf, '/');
+            soname = soname ? soname + 1 : buf;
+            if ((ver = strstr(soname, ".so.")) && (ver = strchr(ver + 4, '.')))
+                *ver = '\0';
+        } else if (libDir && access(so, F_OK) == 0) {
+            soname = basename(soBaseC);
+        } else {
+            soname = NULL;
+        }
+        if (libDir) {
+            WRITE_BUFFER(*farmed, libDir);
+            WRITE_BUFFER(*tofree, libDir);
+        }
+        if (!soname) {
+            free(soBaseC);
+            free(soDirC);
+            continue;
+        }
 
-        while (fgets(lbuf, lbufsz, f)) {
-            lbufused = strlen(lbuf);
+        ORL(target, malloc, NULL, (strlen(libDir) + strlen(soname) + 2));
+        sprintf(target, "%s/%s", libDir, soname);
+        ORL(name, malloc, NULL, (strlen(farm) + strlen(soname) + 2));
+        sprintf(name, "%s/%s", farm, soname);
 
-            /* read in the remainder of the line */
-            while (lbuf[lbufused-1] != '\n') {
-                lbufsz *= 2;
-                ORL(lbuf, realloc, NULL, (lbuf, lbufsz));
-                if (!fgets(lbuf + lbufused, lbufsz - lbufused, f)) break;
-                lbufused = strlen(lbuf);
-            }
+        /* symlink won't replace the name, so if another link is taking it
+         * for another library at the same time, only one of us gets it */
+        if (symlink(target, name) != 0) {
+            int err = errno;
+            len = readlink(name, buf, sizeof(buf) - 1);
+            if (len >= 0) buf[len] = '\0';
 
-            /* is this a dependency_libs line? */
-            if (!strncmp(lbuf, "dependency_libs='", 17)) {
-                char *part, *saveptr;
-                char *dlibs = lbuf + 17;
-                char *end = strrchr(dlibs, '\'');
-                if (end) *end = '\0';
-
-                /* now go one by one through the libs */
-                part = strtok_r(dlibs, " ", &saveptr);
-                while (part) {
-                    /* if this is a .la file, need to recurse */
-                    char *ext = strrchr(part, '.');
-                    if (ext && !strcmp(ext, ".la")) {
-                        linkLaFile(opt, buildLib, outCmd, libDirs, NULL, tofree, part);
-
-                    } else {
-                        /* otherwise, just add it */
-                        char *pdup;
-                        ORL(pdup, strdup, NULL, (part));
-                        WRITE_BUFFER(*outCmd, pdup);
-                        WRITE_BUFFER(*tofree, pdup);
+            if (err != EEXIST || len < 0) {
+                ok = 0;
 
-                    }
+            } else if (!strcmp(buf, target)) {
+                /* already ours */
 
-                    part = strtok_r(NULL, " ", &saveptr);
+            } else if (access(name, F_OK) == 0) {
+                /* another library is using the name, so we can't */
+                ok = 0;
+
+            } else {
+                /* a stale link, so replace it all at once, and make sure no
+                 * other link replaced it after us */
+                tmpName = tmpOutputName(opt, name);
+                unlink(tmpName);
+                if (symlink(target, tmpName) != 0 ||
+                    rename(tmpName, name) != 0) {
+                    unlink(tmpName);
+                    ok = 0;
+                } else {
+                    len = readlink(name, buf, sizeof(buf) - 1);
+                    if (len >= 0) buf[len] = '\0';
+                    if (len < 0 || strcmp(buf, target)) ok = 0;
                 }
+                free(tmpName);
+
             }
         }
 
-        free(lbuf);
-        fclose(f);
+        free(name);
+        free(target);
+        free(soBaseC);
+        free(soDirC);
     }
 
+    return ok ? farm : NULL;
 }
 
 static void ltlink(struct Options *opt)
 {
-    struct Buffer outCmd, outAr, libDirs, dependencyLibs, tofree;
-    size_t i;
+    struct Buffer outCmd, outAr, libDirs, soFiles, dependencyLibs, objects,
+                  laFiles, tofree;
+    size_t i, j, k;
     char *ext;
     int tmpi;
+    int keep = opt->keepUnchanged && !opt->dryRun;
+    int thin = 0;
+    pid_t arPid = 0;
+    int libReplaced = 0;
 
     /* options */
     int major = 0,
@@ -954,6 +4513,7 @@ static void ltlink(struct Options *opt)
         module = 0,
         avoidVersion = 0,
         rpathSpecified = 0,
+        noWrapper = opt->noWrappers,
         insane = 0;
     char *outName = NULL,
          *rpath = NULL;
@@ -1014,7 +4574,10 @@ static void ltlink(struct Options *opt)
     /* allocate our buffers */
     INIT_BUFFER(outCmd);
     INIT_BUFFER(outAr);
+    INIT_BUFFER(objects);
+    INIT_BUFFER(laFiles);
     INIT_BUFFER(libDirs);
+    INIT_BUFFER(soFiles);
     INIT_BUFFER(dependencyLibs);
     INIT_BUFFER(tofree);
 
@@ -1115,8 +4678,11 @@ static void ltlink(struct Options *opt)
                 /* ignored for compatibility */
                 i++;
 
+            } else if (!strcmp(arg, "-no-install")) {
+                /* it'll only ever be run from the build tree */
+                noWrapper = 1;
+
             } else if (!strcmp(arg, "-no-fast-install") ||
-                       !strcmp(arg, "-no-install") ||
                        !strcmp(arg, "-no-undefined")) {
                 /* ignored for compatibility */
 
@@ -1163,7 +4729,9 @@ static void ltlink(struct Options *opt)
                 free(loDirC);
 
             } else if (ext && !strcmp(ext, ".la")) {
-                linkLaFile(opt, buildLib, &outCmd, &libDirs, &dependencyLibs, &tofree, arg);
+                /* these are all linked together, and replace this NULL */
+                WRITE_BUFFER(laFiles, arg);
+                WRITE_BUFFER(outCmd, NULL);
 
             } else {
                 WRITE_BUFFER(outAr, arg);
@@ -1179,6 +4747,49 @@ static void ltlink(struct Options *opt)
         execLibtool(opt);
     }
 
+    /* link in the libraries, each where the last .la file needing it was */
+    if (laFiles.bufused) {
+        struct Buffer outLibs, linked;
+        size_t namePos = outNamePos;
+        INIT_BUFFER(outLibs);
+        linkLaFiles(opt, buildLib, &laFiles, &outLibs, &libDirs, &soFiles,
+                    &dependencyLibs, &objects, &tofree);
+
+        INIT_BUFFER(linked);
+        for (i = 0, j = 0; i < outCmd.bufused; i++) {
+            if (i == namePos && outName)
+                outNamePos = linked.bufused;
+            if (outCmd.buf[i]) {
+                WRITE_BUFFER(linked, outCmd.buf[i]);
+                continue;
+            }
+
+            for (; j < outLibs.bufused && outLibs.buf[j]; j++) {
+                char *arg = outLibs.buf[j];
+
+                /* libraries also given after this are already linked late
+                 * enough */
+                if (!strncmp(arg, "-l", 2)) {
+                    for (k = i + 1; k < outCmd.bufused; k++)
+                        if (outCmd.buf[k] && !strcmp(outCmd.buf[k], arg))
+                            break;
+                    if (k < outCmd.bufused) continue;
+                }
+                WRITE_BUFFER(linked, arg);
+            }
+            j++; /* past the NULL */
+        }
+
+        FREE_BUFFER(outCmd);
+        outCmd = linked;
+        FREE_BUFFER(outLibs);
+    }
+    dedupLibs(&dependencyLibs);
+
+    /* objects from convenience libraries go in our archive too */
+    for (i = 0; i < objects.bufused; i++)
+        WRITE_BUFFER(outAr, objects.buf[i]);
+
     /* make sure an output name was specified */
     if (!outName) {
         outName = "a.out";
@@ -1199,35 +4810,95 @@ static void ltlink(struct Options *opt)
     sprintf(libsDir, "%s/.libs", outDir);
     if (!opt->dryRun) mkdir(libsDir, 0777); /* ignore errors */
 
-    /* building a binary involves making a wrapper */
-    if (buildBinary) {
-        char *realName;
+    if (buildBinary && noWrapper && opt->newDtags != 0) {
+        /* the binary can find the build tree's libraries itself, by a
+         * RUNPATH relative to wherever it is */
+        char *realName, *linkName, *rel, *flag;
+        int rpaths = 0;
+
+        for (i = 0; i < libDirs.bufused; i++) {
+            char *libDir = libDirs.buf[i];
+            size_t len = strlen(libDir);
+            if (libDir[0] != '/' || len < 6 ||
+                strcmp(libDir + len - 6, "/.libs"))
+                continue;
+            if (!(rel = relativePath(opt, outDir, libDir))) continue;
+            ORL(flag, malloc, NULL, (strlen(rel) + 20));
+            sprintf(flag, "-Wl,-rpath,$ORIGIN/%s", rel);
+            free(rel);
+            WRITE_BUFFER(outCmd, flag);
+            WRITE_BUFFER(tofree, flag);
+            rpaths = 1;
+        }
+
+        if (rpaths) {
+            /* an RPATH rather than a RUNPATH, as only an RPATH is also
+             * searched for the libraries' own dependencies. This is
+             * GNU-ld-specific, so retry if it doesn't work, unless the
+             * profile says it will. */
+            WRITE_BUFFER(outCmd, "-Wl,--disable-new-dtags");
+            if (opt->newDtags < 0)
+                opt->retryIfFail = 1;
+        }
+
+        linkName = keep ? tmpOutputName(opt, outName) : outName;
+        outCmd.buf[outNamePos] = linkName;
+        WRITE_BUFFER(outCmd, NULL);
+        spawn(opt, outCmd.buf);
+        outCmd.bufused--;
+        if (linkName != outName)
+            commitOutput(opt, linkName, outName);
+
+        /* don't leave an old binary where install would find it */
+        ORL(realName, malloc, NULL, (strlen(outDir) + strlen(outBase) + 8));
+        sprintf(realName, "%s/.libs/%s", outDir, outBase);
+        if (!opt->dryRun) unlink(realName);
+        free(realName);
+
+    } else if (buildBinary) {
+        /* otherwise, building a binary involves making a wrapper */
+        char *realName, *linkName;
 
         ORL(realName, malloc, NULL, (strlen(outDir) + strlen(outBase) + 8));
         sprintf(realName, "%s/.libs/%s", outDir, outBase);
 
         /* do the actual build */
-        outCmd.buf[outNamePos] = realName;
+        linkName = keep ? tmpOutputName(opt, realName) : realName;
+        outCmd.buf[outNamePos] = linkName;
         WRITE_BUFFER(outCmd, NULL);
         spawn(opt, outCmd.buf);
         outCmd.bufused--;
+        if (linkName != realName)
+            commitOutput(opt, linkName, realName);
 
         /* then make the wrapper */
         if (!opt->dryRun) {
-            char *absName;
+            char *absName, *writeName, *farm;
+            struct Buffer farmed;
             FILE *f;
 
-            f = fopen(outName, "w");
+            INIT_BUFFER(farmed);
+            writeName = keep ? tmpOutputName(opt, outName) : outName;
+            f = fopen(writeName, "w");
             if (!f) {
-                perror(outName);
+                perror(writeName);
                 execLibtool(opt);
             }
 
             fputs(BIN_SCRIPT_1, f);
 
-            /* write all the library paths */
-            for (i = 0; i < libDirs.bufused; i++) {
-                if (i != 0) fputs(":", f);
+            /* write all the library paths, with the libraries from .la files
+             * in the farm if possible */
+            farm = opt->libFarm ?
+                libFarm(opt, &soFiles, &farmed, &tofree) : NULL;
+            if (farm) fputs(farm, f);
+            for (i = 0, j = !!farm; i < libDirs.bufused; i++) {
+                if (farm) {
+                    for (k = 0; k < farmed.bufused; k++)
+                        if (!strcmp(farmed.buf[k], libDirs.buf[i])) break;
+                    if (k < farmed.bufused) continue;
+                }
+                if (j++ != 0) fputs(":", f);
                 fputs(libDirs.buf[i], f);
             }
 
@@ -1249,7 +4920,11 @@ static void ltlink(struct Options *opt)
             fclose(f);
 
             /* now try to make it executable */
-            chmod(outName, 0755);
+            chmod(writeName, 0755);
+            if (writeName != outName)
+                commitOutput(opt, writeName, outName);
+
+            FREE_BUFFER(farmed);
         }
 
         free(realName);
@@ -1268,18 +4943,34 @@ static void ltlink(struct Options *opt)
 
         ORL(apath, malloc, NULL, (strlen(outDir) + strlen(afile) + 8));
         sprintf(apath, "%s/.libs/%s", outDir, afile);
-        outAr.buf[2] = apath;
-
-        /* run ar */
-        WRITE_BUFFER(outAr, NULL);
-        spawn(opt, outAr.buf);
-        outAr.bufused--;
-
-        /* and make sure to ranlib too! */
-        outAr.buf[1] = "ranlib";
-        outAr.buf[3] = NULL;
-        spawn(opt, outAr.buf + 1);
 
+        /* convenience libraries are only used in the build tree, so they
+         * needn't copy the objects */
+        thin = opt->thinArchives && buildPicA;
+        if (thin) outAr.buf[1] = "rcT";
+
+        /* the .a and the .so don't depend on each other, so build the .a in
+         * the background if we can get a job for it */
+        if (buildSo && jobTake(opt)) {
+            fflush(stdout);
+            fflush(stderr);
+            arPid = fork();
+            if (arPid == 0) {
+                /* failures are for the parent to deal with */
+                jobserver.held = jobserver.local = 0;
+                opt->retryIfFail = 0;
+                exit(ltarchive(opt, &outAr, apath, keep, thin) ?
+                     0 : AR_KEPT_STATUS);
+            } else if (arPid == -1) {
+                jobGive();
+                arPid = 0;
+            } else {
+                /* if we give up before waiting for it, that will */
+                jobserver.child = arPid;
+            }
+        }
+        if (!arPid)
+            libReplaced |= ltarchive(opt, &outAr, apath, keep, thin);
         free(apath);
     }
 
@@ -1288,6 +4979,7 @@ static void ltlink(struct Options *opt)
         char *sopath = NULL,
              *longpath = NULL,
              *linkpath = NULL,
+             *outpath = NULL,
              *sonameFlag = NULL;
 
         if (!avoidVersion) {
@@ -1322,12 +5014,15 @@ static void ltlink(struct Options *opt)
         }
 #undef FULLPATH
 
-        /* unlink anything that already exists */
-        unlink(sopath);
-        if (longpath)
-            unlink(longpath);
-        if (linkpath)
-            unlink(linkpath);
+        /* unlink anything that already exists, unless we're going to compare
+         * with it */
+        if (!keep) {
+            unlink(sopath);
+            if (longpath)
+                unlink(longpath);
+            if (linkpath)
+                unlink(linkpath);
+        }
 
         /* set up the link command */
         ORL(sonameFlag, malloc, NULL, (strlen(soname) + 8));
@@ -1335,20 +5030,25 @@ static void ltlink(struct Options *opt)
         WRITE_BUFFER(outCmd, "-shared");
         WRITE_BUFFER(outCmd, sonameFlag);
         WRITE_BUFFER(tofree, sonameFlag);
-        outCmd.buf[outNamePos] = longpath ? longpath : sopath;
+        outpath = longpath ? longpath : sopath;
+        outCmd.buf[outNamePos] = keep ? tmpOutputName(opt, outpath) : outpath;
 
         /* link */
         WRITE_BUFFER(outCmd, NULL);
         spawn(opt, outCmd.buf);
         outCmd.bufused--;
+        if (outCmd.buf[outNamePos] != outpath)
+            libReplaced |= commitOutput(opt, outCmd.buf[outNamePos], outpath);
+        else
+            libReplaced = 1;
 
         if (!opt->dryRun && !avoidVersion) {
             /* link in the shorter names */
-            if ((tmpi = symlink(longname, sopath)) < 0) {
+            if ((tmpi = updateSymlink(longname, sopath)) < 0) {
                 perror(sopath);
                 exit(1);
             }
-            if ((tmpi = symlink(longname, linkpath)) < 0) {
+            if ((tmpi = updateSymlink(longname, linkpath)) < 0) {
                 perror(linkpath);
                 exit(1);
             }
@@ -1359,11 +5059,27 @@ static void ltlink(struct Options *opt)
         free(linkpath);
     }
 
-    /* finally, make the .la file */
+    /* wait for the .a if we built it in the background */
+    if (arPid) {
+        jobserver.child = 0;
+        if (waitpid(arPid, &tmpi, 0) != arPid ||
+            (tmpi != 0 && !(WIFEXITED(tmpi) &&
+                            WEXITSTATUS(tmpi) == AR_KEPT_STATUS))) {
+            jobGive();
+            spawnFailed(opt);
+        }
+        if (tmpi == 0) libReplaced = 1;
+        jobGive();
+    }
+
+    /* finally, make the .la file, which is what make sees, so it's only kept
+     * if the libraries were too */
     if (buildLib) {
-        FILE *f = fopen(outName, "w");
+        char *writeName = (keep && !libReplaced) ?
+                          tmpOutputName(opt, outName) : outName;
+        FILE *f = fopen(writeName, "w");
         if (!f) {
-            perror(outName);
+            perror(writeName);
             execLibtool(opt);
         }
 
@@ -1393,6 +5109,28 @@ static void ltlink(struct Options *opt)
             fprintf(f, " %s", dependencyLibs.buf[i]);
         fprintf(f, "'\n");
 
+        /* dependency_libs is the whole closure, in order, so libraries
+         * linking to this one can use it without reading the rest */
+        writeClosure(opt, f, &dependencyLibs);
+
+        /* a convenience library's objects can be linked directly into the
+         * libraries that use it, if they're all plain objects */
+        if (buildPicA && !buildSo) {
+            for (i = 3; i < outAr.bufused; i++) {
+                ext = strrchr(outAr.buf[i], '.');
+                if (!ext || strcmp(ext, ".o")) break;
+            }
+            if (i == outAr.bufused) {
+                fprintf(f, "mlibtool_objects='");
+                for (i = 3; i < outAr.bufused; i++) {
+                    char *realo = realpath(outAr.buf[i], NULL);
+                    fprintf(f, " %s", realo ? realo : outAr.buf[i]);
+                    free(realo);
+                }
+                fprintf(f, "'\n");
+            }
+        }
+
         /* version info */
         fprintf(f, "current=%d\n"
                    "age=%d\n"
@@ -1410,6 +5148,8 @@ static void ltlink(struct Options *opt)
                    (rpath ? rpath : ""));
 
         fclose(f);
+        if (writeName != outName)
+            commitOutput(opt, writeName, outName);
     }
 
     free(afile);
@@ -1424,25 +5164,634 @@ static void ltlink(struct Options *opt)
 
     FREE_BUFFER(tofree);
     FREE_BUFFER(dependencyLibs);
+    FREE_BUFFER(soFiles);
     FREE_BUFFER(libDirs);
+    FREE_BUFFER(laFiles);
+    FREE_BUFFER(objects);
     FREE_BUFFER(outAr);
     FREE_BUFFER(outCmd);
 }
 
+/* Get the name a file will be installed as, in or as target */
+static char *installName(struct Options *opt, char *target, char *base,
+                         struct Buffer *tofree)
+{
+    struct stat sbuf;
+    char *name;
+    if (stat(target, &sbuf) != 0 || !S_ISDIR(sbuf.st_mode))
+        return target;
+    ORL(name, malloc, NULL, (strlen(target) + strlen(base) + 2));
+    sprintf(name, "%s/%s", target, base);
+    WRITE_BUFFER(*tofree, name);
+    return name;
+}
+
+/* Is this a thin archive? */
+static int isThinArchive(char *path)
+{
+    char magic[8];
+    int fd, ret = 0;
+    if ((fd = open(path, O_RDONLY)) < 0) return 0;
+    if (read(fd, magic, 8) == 8 && !memcmp(magic, "!<thin>\n", 8))
+        ret = 1;
+    close(fd);
+    return ret;
+}
+
+/* Is this RUNPATH entry one of the build tree's .libs directories, as
+ * ltlink adds when it doesn't make a wrapper? */
+static int isBuildRunpath(const char *dir, size_t len)
+{
+    return len >= 13 && !strncmp(dir, "$ORIGIN", 7) &&
+           (dir[7] == '/' || dir[7] == ':') &&
+           !strncmp(dir + len - 6, "/.libs", 6);
+}
+
+/* A binary linked without a wrapper refers to the build tree in its RUNPATH.
+ * Write a copy of it without that for installing, into a directory of our
+ * own (made in *cleanDir if it isn't yet) so as not to touch the build tree.
+ * Returns the copy's name (allocated), or NULL if there was nothing to remove
+ * (or it's not an executable ELF file). */
+static char *installCleanBinary(struct Options *opt, char *path,
+                                char **cleanDir)
+{
+    struct stat sbuf;
+    unsigned char *data, *ph, *dyn = NULL;
+    char *base, *dest = NULL;
+    const char *tmpDir;
+    int fd, is64, be, changed = 0;
+    uint64_t size, phoff, phentsize, phnum, dynSize = 0, entSize, strtab = 0;
+    uint64_t strOff = 0, i, count;
+    FILE *f;
+
+#define RD(p, sz) elfRead((p), (sz), be)
+#define PH(i) (data + phoff + (i) * phentsize)
+#define ADDR(p, o32, o64) RD((p) + (is64 ? (o64) : (o32)), is64 ? 8 : 4)
+
+    /* only programs, not headers or data */
+    if (stat(path, &sbuf) != 0 || !S_ISREG(sbuf.st_mode) ||
+        !(sbuf.st_mode & 0111) || sbuf.st_size < 64)
+        return NULL;
+
+    if ((fd = open(path, O_RDONLY)) < 0) return NULL;
+    /* (and only what we can map whole) */
+    if (fstat(fd, &sbuf) != 0 || sbuf.st_size < 64 ||
+        (uint64_t) sbuf.st_size != (size_t) sbuf.st_size) {
+        close(fd);
+        return NULL;
+    }
+    size = sbuf.st_size;
+    data = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    if (memcmp(data, "\177ELF", 4) || (data[4] != 1 && data[4] != 2) ||
+        (data[5] != 1 && data[5] != 2))
+        goto out;
+    is64 = (data[4] == 2);
+    be = (data[5] == 2);
+    entSize = is64 ? 16 : 8;
+    phoff = ADDR(data, 28, 32);
+    phentsize = RD(data + (is64 ? 54 : 42), 2);
+    phnum = RD(data + (is64 ? 56 : 44), 2);
+    if (phoff > size || phentsize < (is64 ? 56 : 32) ||
+        phnum > (size - phoff) / phentsize)
+        goto out;
+
+    /* find the dynamic section */
+    for (i = 0; i < phnum; i++) {
+        if (RD(PH(i), 4) == 2 /* PT_DYNAMIC */) {
+            uint64_t off = ADDR(PH(i), 4, 8);
+            dynSize = ADDR(PH(i), 16, 32);
+            if (off > size || dynSize > size - off) goto out;
+            dyn = data + off;
+        }
+    }
+    if (!dyn) goto out;
+    count = dynSize / entSize;
+
+    /* and the string table its RUNPATH is in, from its address */
+    for (i = 0; i < count; i++) {
+        if (ADDR(dyn + i * entSize, 0, 0) == 5 /* DT_STRTAB */)
+            strtab = ADDR(dyn + i * entSize, 4, 8);
+    }
+    for (i = 0; i < phnum; i++) {
+        ph = PH(i);
+        if (RD(ph, 4) == 1 /* PT_LOAD */ && ADDR(ph, 8, 16) <= strtab &&
+            strtab - ADDR(ph, 8, 16) < ADDR(ph, 16, 32))
+            strOff = strtab - ADDR(ph, 8, 16) + ADDR(ph, 4, 8);
+    }
+    if (!strOff || strOff >= size) goto out;
+
+    /* now take our directories out of each RPATH and RUNPATH, removing the
+     * entry altogether if that leaves it empty */
+    for (i = count; i > 0; i--) {
+        unsigned char *ent = dyn + (i-1) * entSize;
+        uint64_t tag = ADDR(ent, 0, 0), val;
+        char *rp, *in, *out, *end;
+
+        if (tag != 15 /* DT_RPATH */ && tag != 29 /* DT_RUNPATH */) continue;
+        val = ADDR(ent, 4, 8);
+        if (val >= size - strOff ||
+            !memchr(data + strOff + val, '\0', size - strOff - val))
+            goto out;
+        rp = (char *) data + strOff + val;
+
+        for (in = out = rp; *in; in = *end ? end + 1 : end) {
+            size_t len;
+            end = strchr(in, ':');
+            if (!end) end = in + strlen(in);
+            len = end - in;
+            if (isBuildRunpath(in, len)) continue;
+            if (out != rp) *out++ = ':';
+            memmove(out, in, len);
+            out += len;
+        }
+        if (out == in) continue;
+        memset(out, 0, in - out);
+        changed = 1;
+
+        if (out == rp) {
+            memmove(ent, ent + entSize, (count - i) * entSize);
+            memset(dyn + (count-1) * entSize, 0, entSize);
+        }
+    }
+    if (!changed) goto out;
+
+    /* make our directory, which mkdir won't let anyone else have made */
+    if (!*cleanDir) {
+        tmpDir = getenv("TMPDIR");
+        if (!tmpDir || !tmpDir[0]) tmpDir = "/tmp";
+        ORL(*cleanDir, malloc, NULL, (strlen(tmpDir) + 4*sizeof(long) + 11));
+        sprintf(*cleanDir, "%s/mlibtool%ld", tmpDir, (long) getpid());
+        if (mkdir(*cleanDir, 0700) != 0) {
+            perror(*cleanDir);
+            free(*cleanDir);
+            *cleanDir = NULL;
+            goto out;
+        }
+    }
+
+    /* write the copy, under the same name as install takes it from there */
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    ORL(dest, malloc, NULL, (strlen(*cleanDir) + strlen(base) + 2));
+    sprintf(dest, "%s/%s", *cleanDir, base);
+    f = fopen(dest, "wb");
+    if (!f || fwrite(data, 1, size, f) != size ||
+        fclose(f) != 0 || chmod(dest, sbuf.st_mode & 07777) != 0) {
+        perror(dest);
+        unlink(dest);
+        execLibtool(opt);
+    }
+
+out:
+    munmap(data, size);
+    return dest;
+
+#undef ADDR
+#undef PH
+#undef RD
+}
+
+/* what an install command asks for, when mlibtool can do it itself */
+struct InstallFlags {
+    mode_t mode;
+    int strip, preserve, makeDirs;
+};
+
+/* a file to install, as install would or as cp -P would */
+struct InstallFile {
+    char *from, *to;
+    int asInstall;
+};
+
+/* Read the flags of an install or install-sh command. Returns the index of
+ * the first file, or 0 if it's not one we can do ourselves. */
+static size_t installFlags(struct Options *opt, struct InstallFlags *flags)
+{
+    char *prog, *end;
+    size_t i;
+    long mode;
+
+    prog = strrchr(opt->cmd[0], '/');
+    prog = prog ? prog + 1 : opt->cmd[0];
+    if (strcmp(prog, "install") && strcmp(prog, "ginstall") &&
+        strcmp(prog, "install-sh") && strcmp(prog, "install.sh"))
+        return 0;
+
+    memset(flags, 0, sizeof(struct InstallFlags));
+    flags->mode = 0755;
+    for (i = 1; opt->cmd[i] && opt->cmd[i][0] == '-'; i++) {
+        char *arg = opt->cmd[i];
+
+        if (!strcmp(arg, "-c")) {
+            /* we always copy */
+
+        } else if (!strcmp(arg, "-m") && opt->cmd[i+1]) {
+            /* only numeric modes */
+            mode = strtol(opt->cmd[++i], &end, 8);
+            if (end == opt->cmd[i] || *end || mode < 0 || mode > 07777)
+                return 0;
+            flags->mode = mode;
+
+        } else if (!strcmp(arg, "-s")) {
+            flags->strip = 1;
+
+        } else if (!strcmp(arg, "-p")) {
+            flags->preserve = 1;
+
+        } else if (!strcmp(arg, "-D")) {
+            flags->makeDirs = 1;
+
+        } else {
+            /* -o, -g, -d, -t and so on are left to install */
+            return 0;
+
+        }
+    }
+
+    return opt->cmd[i] ? i : 0;
+}
+
+/* Make a directory and any parents it needs. Returns -1 on failure. */
+static int makeDirs(struct Options *opt, const char *dir)
+{
+    char *path, *slash;
+    struct stat sbuf;
+    int ret;
+
+    ORL(path, strdup, NULL, (dir));
+    for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0777); /* checked at the end */
+        *slash = '/';
+    }
+    mkdir(path, 0777);
+    ret = (stat(path, &sbuf) == 0 && S_ISDIR(sbuf.st_mode)) ? 0 : -1;
+    free(path);
+    return ret;
+}
+
+/* Is the file already installed as it would be? If it would be stripped,
+ * from is the stripped copy. */
+static int installedAlready(struct InstallFile *file, char *from, mode_t mode)
+{
+    struct stat sbuf;
+    return lstat(file->to, &sbuf) == 0 && S_ISREG(sbuf.st_mode) &&
+           (sbuf.st_mode & 07777) == mode && sameContents(from, file->to);
+}
+
+/* Install one file, under a temporary name and then renamed into place,
+ * unless it's already there. Returns -1 on failure. */
+static int installFile(struct Options *opt, struct InstallFlags *flags,
+                       struct InstallFile *file, mode_t mask)
+{
+    struct stat sbuf;
+    char *tmpName, buf[1024], oldBuf[1024];
+    mode_t mode;
+    ssize_t len, oldLen;
+    int strip = file->asInstall && flags->strip;
+    int ret = -1;
+
+    if (lstat(file->from, &sbuf) != 0) {
+        perror(file->from);
+        return -1;
+    }
+    mode = file->asInstall ? flags->mode : (sbuf.st_mode & 07777 & ~mask);
+
+    tmpName = tmpOutputName(opt, file->to);
+    unlink(tmpName);
+
+    if (!file->asInstall && S_ISLNK(sbuf.st_mode)) {
+        /* a link to the library, so link to it again, if it isn't already */
+        if ((len = readlink(file->from, buf, sizeof(buf) - 1)) < 0)
+            goto out;
+        buf[len] = '\0';
+        oldLen = readlink(file->to, oldBuf, sizeof(oldBuf) - 1);
+        if (oldLen == len && !memcmp(oldBuf, buf, len)) {
+            ret = 0;
+            goto out;
+        }
+        if (symlink(buf, tmpName) != 0)
+            goto out;
+
+    } else {
+        /* leave identical files alone, so as not to disturb anything using
+         * them */
+        if (!strip && installedAlready(file, file->from, mode)) {
+            ret = 0;
+            goto preserve;
+        }
+
+        if (copyFile(file->from, tmpName, 0600) != 0)
+            goto out;
+
+        if (file->asInstall && flags->strip) {
+            char *stripCmd[3];
+            stripCmd[0] = getenv("STRIPPROG");
+            if (!stripCmd[0] || !stripCmd[0][0]) stripCmd[0] = "strip";
+            stripCmd[1] = tmpName;
+            stripCmd[2] = NULL;
+            if (spawnWait(spawnStart(opt, stripCmd, -1), stripCmd))
+                goto out;
+            if (installedAlready(file, tmpName, mode)) {
+                unlink(tmpName);
+                ret = 0;
+                goto preserve;
+            }
+        }
+
+        if (file->asInstall && flags->preserve) {
+            struct utimbuf times;
+            times.actime = sbuf.st_atime;
+            times.modtime = sbuf.st_mtime;
+            if (utime(tmpName, &times) != 0)
+                goto out;
+        }
+
+        if (chmod(tmpName, mode) != 0)
+            goto out;
+
+    }
+
+    if (rename(tmpName, file->to) == 0)
+        ret = 0;
+    goto out;
+
+preserve:
+    /* the contents are the same, but not necessarily the times */
+    if (file->asInstall && flags->preserve) {
+        struct utimbuf times;
+        times.actime = sbuf.st_atime;
+        times.modtime = sbuf.st_mtime;
+        if (utime(file->to, &times) != 0)
+            ret = -1;
+    }
+
+out:
+    if (ret != 0) {
+        perror(file->to);
+        unlink(tmpName);
+    }
+    free(tmpName);
+    return ret;
+}
+
+/* Install files without running install or cp, spread over as many children
+ * as make's jobserver or opt->jobs allow. Returns -1 if any failed. */
+static int installFiles(struct Options *opt, struct InstallFlags *flags,
+                        struct InstallFile *files, size_t count)
+{
+    size_t workers = 1, worker = 0, i;
+    pid_t *pids;
+    mode_t mask;
+    int failed = 0, tmpi;
+
+    /* like cp, files take their modes from their sources, less the umask */
+    mask = umask(0);
+    umask(mask);
+
+    while (workers < count && (!opt->jobs || workers < (size_t) opt->jobs) &&
+           jobTake(opt))
+        workers++;
+
+    /* each child takes every workers'th file, and we take the first lot */
+    ORL(pids, calloc, NULL, (workers, sizeof(pid_t)));
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 1; i < workers; i++) {
+        ORX(pids[i], fork, -1, ());
+        if (pids[i] == 0) {
+            /* the jobs we've taken are still ours, not the child's */
+            jobserver.held = jobserver.local = 0;
+            worker = i;
+            break;
+        }
+    }
+
+    for (i = worker; i < count; i += workers) {
+        if (installFile(opt, flags, files + i, mask) != 0)
+            failed = 1;
+    }
+    if (worker != 0) {
+        /* the rest of our exit is the parent's */
+        fflush(stdout);
+        fflush(stderr);
+        _exit(failed);
+    }
+
+    for (i = 1; i < workers; i++) {
+        if (waitpid(pids[i], &tmpi, 0) != pids[i] || tmpi != 0)
+            failed = 1;
+        jobGive();
+    }
+    free(pids);
+
+    return failed ? -1 : 0;
+}
+
+/* Install the files install and cp would, ourselves. Returns -1 if we
+ * can't, or if anything failed, so the commands should be run after all. */
+static int ltinstallFiles(struct Options *opt, struct InstallFlags *flags,
+                          struct Buffer *installCmd, size_t first,
+                          struct Buffer *cpCmd, char *target,
+                          struct Buffer *tofree)
+{
+    struct InstallFile *files;
+    struct stat sbuf;
+    char *targetC, *base;
+    size_t count = 0, i;
+    int ret;
+
+    /* leading directories only on request, and if there's more than one
+     * file it must go into a directory */
+    if (flags->makeDirs) {
+        ORL(targetC, strdup, NULL, (target));
+        ret = makeDirs(opt, dirname(targetC));
+        free(targetC);
+        if (ret != 0) return -1;
+    }
+    if (installCmd->bufused - first + cpCmd->bufused - 2 > 1 &&
+        (stat(target, &sbuf) != 0 || !S_ISDIR(sbuf.st_mode)))
+        return -1;
+
+    ORL(files, malloc, NULL, ((installCmd->bufused + cpCmd->bufused) *
+                              sizeof(struct InstallFile)));
+    for (i = first; i < installCmd->bufused; i++, count++) {
+        files[count].from = installCmd->buf[i];
+        files[count].asInstall = 1;
+    }
+    for (i = 2; i < cpCmd->bufused; i++, count++) {
+        files[count].from = cpCmd->buf[i];
+        files[count].asInstall = 0;
+    }
+    for (i = 0; i < count; i++) {
+        base = strrchr(files[i].from, '/');
+        base = base ? base + 1 : files[i].from;
+        files[i].to = installName(opt, target, base, tofree);
+    }
+
+    /* show what we're doing as the commands we would have run */
+    WRITE_BUFFER(*installCmd, target);
+    WRITE_BUFFER(*installCmd, NULL);
+    if (installCmd->bufused - 2 > first) showCommand(opt, installCmd->buf);
+    installCmd->bufused -= 2;
+    WRITE_BUFFER(*cpCmd, target);
+    WRITE_BUFFER(*cpCmd, NULL);
+    if (cpCmd->bufused > 4) showCommand(opt, cpCmd->buf);
+    cpCmd->bufused -= 2;
+
+    ret = installFiles(opt, flags, files, count);
+    free(files);
+    if (ret != 0 && !opt->quiet)
+        fprintf(stderr, "mlibtool: trying install again with the commands\n");
+    return ret;
+}
+
+/* Install a thin archive as a full archive of its members, as a thin archive
+ * is no use outside of the build tree. */
+static void installThinArchive(struct Options *opt, char *path, char *dest)
+{
+    struct Buffer arCmd, tofree;
+    struct stat sbuf;
+    char *data, *longNames = NULL, *dirC, *dir, *tmpName;
+    size_t i, pos, size, longSize = 0;
+    int useAr = 0;
+    mode_t mask;
+    FILE *f;
+
+    INIT_BUFFER(arCmd);
+    INIT_BUFFER(tofree);
+    WRITE_BUFFER(arCmd, "ar");
+    WRITE_BUFFER(arCmd, "rc");
+    WRITE_BUFFER(arCmd, dest);
+
+    /* read in the thin archive, which is just an index and names */
+    if (!(f = fopen(path, "rb")) || fstat(fileno(f), &sbuf) != 0) {
+        perror(path);
+        exit(1);
+    }
+    size = sbuf.st_size;
+    ORL(data, malloc, NULL, (size + 1));
+    if (fread(data, 1, size, f) != size) {
+        perror(path);
+        exit(1);
+    }
+    fclose(f);
+    data[size] = '\0';
+
+    /* find the members, relative to the archive */
+    ORL(dirC, strdup, NULL, (path));
+    dir = dirname(dirC);
+    for (pos = 8; pos + 60 <= size; ) {
+        char *hdr = data + pos;
+        size_t msize = strtoul(hdr + 48, NULL, 10);
+        char *name = NULL, *end, *full;
+        pos += 60;
+
+        if (hdr[0] == '/' && (hdr[1] == ' ' || !strncmp(hdr, "/SYM64/", 7))) {
+            /* the index */
+            pos += msize + (msize & 1);
+            continue;
+
+        } else if (!strncmp(hdr, "// ", 3)) {
+            /* the long names */
+            longNames = data + pos;
+            longSize = msize;
+            pos += msize + (msize & 1);
+            continue;
+
+        } else if (hdr[0] == '/' && longNames) {
+            size_t off = strtoul(hdr + 1, NULL, 10);
+            if (off < longSize) {
+                name = longNames + off;
+                end = strstr(name, "/\n");
+            }
+
+        } else {
+            name = hdr;
+            end = memchr(name, '/', 16);
+
+        }
+        if (!name || !end) {
+            fprintf(stderr, "mlibtool: %s: malformed thin archive\n", path);
+            exit(1);
+        }
+        *end = '\0';
+
+        if (name[0] == '/') {
+            full = name;
+        } else {
+            ORL(full, malloc, NULL, (strlen(dir) + strlen(name) + 2));
+            sprintf(full, "%s/%s", dir, name);
+            WRITE_BUFFER(tofree, full);
+        }
+        WRITE_BUFFER(arCmd, full);
+    }
+    WRITE_BUFFER(arCmd, NULL);
+    arCmd.bufused--;
+
+    /* and write the full archive (keeping the old one if it's the same), with
+     * ar if we can't */
+    if (opt->dryRun) {
+        showCommand(opt, arCmd.buf);
+    } else {
+        tmpName = tmpOutputName(opt, dest);
+        if (writeArchive(opt, arCmd.buf + 3, arCmd.bufused - 3, tmpName,
+                         0) == 0) {
+            if (!opt->quiet)
+                fprintf(stderr, "mlibtool: wrote %s\n", dest);
+            commitOutput(opt, tmpName, dest);
+        } else {
+            unlink(tmpName);
+            free(tmpName);
+            useAr = 1;
+        }
+    }
+    if (useAr) {
+        unlink(dest);
+        spawn(opt, arCmd.buf);
+        arCmd.buf[1] = "ranlib";
+        arCmd.buf[3] = NULL;
+        spawn(opt, arCmd.buf + 1);
+    }
+
+    /* like the other libraries, which cp copies, it takes its mode from the
+     * source, less the umask */
+    mask = umask(0);
+    umask(mask);
+    if (!opt->dryRun && chmod(dest, sbuf.st_mode & 07777 & ~mask) != 0) {
+        perror(dest);
+        exit(1);
+    }
+
+    for (i = 0; i < tofree.bufused; i++) free(tofree.buf[i]);
+    FREE_BUFFER(tofree);
+    FREE_BUFFER(arCmd);
+    free(dirC);
+    free(data);
+}
+
 static void ltinstall(struct Options *opt)
 {
-    size_t i, j;
+    size_t i, j, first;
     char *dirC, *dir, *baseC, *base, *ext, *target;
-    struct Buffer installCmd, cpCmd, tofree;
+    char *cleanDir = NULL;
+    struct Buffer installCmd, cpCmd, tofree, cleaned;
+    struct InstallFlags flags;
     int haveInst = 0, haveCp = 0;
 
     INIT_BUFFER(installCmd);
     INIT_BUFFER(cpCmd);
     INIT_BUFFER(tofree);
+    INIT_BUFFER(cleaned);
 
     /* copy in the install command as stands */
+    first = installFlags(opt, &flags);
     WRITE_BUFFER(installCmd, opt->cmd[0]);
-    for (i = 1; opt->cmd[i] && opt->cmd[i][0] == '-'; i++) {
+    for (i = 1; opt->cmd[i] && (first ? i < first : opt->cmd[i][0] == '-');
+         i++) {
         WRITE_BUFFER(installCmd, opt->cmd[i]);
     }
 
@@ -1452,7 +5801,7 @@ static void ltinstall(struct Options *opt)
 
     /* if the command seems invalid, just run it */
     if (!opt->cmd[i]) {
-        spawn(opt, opt->cmd);
+        spawnLast(opt, opt->cmd);
         return;
     }
 
@@ -1482,17 +5831,25 @@ static void ltinstall(struct Options *opt)
 
             haveInst = 1;
 
-            /* check if there's a .libs version */
+            /* check if there's a .libs version (the program behind a
+             * wrapper), or if it's a program that runs from the build tree
+             * without a wrapper, so needs a copy without that */
             ORL(libsF, malloc, NULL, (strlen(dir) + strlen(base) + 8));
             sprintf(libsF, "%s/.libs/%s", dir, base);
-            if (access(libsF, F_OK) == 0) {
+            if (access(libsF, F_OK) != 0) {
+                free(libsF);
+                libsF = NULL;
+                if (!opt->dryRun &&
+                    (libsF = installCleanBinary(opt, opt->cmd[i], &cleanDir)))
+                    WRITE_BUFFER(cleaned, libsF);
+            }
+            if (libsF) {
                 /* use that one */
                 WRITE_BUFFER(installCmd, libsF);
                 WRITE_BUFFER(tofree, libsF);
             } else {
                 /* use the provided argument */
                 WRITE_BUFFER(installCmd, opt->cmd[i]);
-                free(libsF);
             }
 
         } else {
@@ -1534,6 +5891,14 @@ static void ltinstall(struct Options *opt)
                             ORL(fullName, malloc, NULL, (strlen(dir) + strlen(part) + 8));
                             sprintf(fullName, "%s/.libs/%s", dir, part);
 
+                            if (isThinArchive(fullName)) {
+                                installThinArchive(opt, fullName,
+                                                   installName(opt, target, part, &tofree));
+                                free(fullName);
+                                part = strtok_r(NULL, " ", &saveptr);
+                                continue;
+                            }
+
                             haveCp = 1;
                             WRITE_BUFFER(cpCmd, fullName);
                             WRITE_BUFFER(tofree, fullName);
@@ -1554,21 +5919,38 @@ static void ltinstall(struct Options *opt)
 
     }
 
-    /* now run the commands */
+    /* now do it ourselves if we can, or run the commands */
+    if (first && !opt->dryRun &&
+        ltinstallFiles(opt, &flags, &installCmd, first, &cpCmd, target,
+                       &tofree) == 0) {
+        haveInst = haveCp = 0;
+    }
     if (haveInst) {
         WRITE_BUFFER(installCmd, target);
         WRITE_BUFFER(installCmd, NULL);
-        spawn(opt, installCmd.buf);
+        if (haveCp || cleanDir)
+            spawn(opt, installCmd.buf);
+        else
+            spawnLast(opt, installCmd.buf);
+    }
+
+    /* the cleaned copies have been installed, so aren't needed any more */
+    if (cleanDir) {
+        for (i = 0; i < cleaned.bufused; i++) unlink(cleaned.buf[i]);
+        rmdir(cleanDir);
+        free(cleanDir);
     }
+
     if (haveCp) {
         WRITE_BUFFER(cpCmd, target);
         WRITE_BUFFER(cpCmd, NULL);
-        spawn(opt, cpCmd.buf);
+        spawnLast(opt, cpCmd.buf);
     }
 
     /* and free everything */
     for (i = 0; i < tofree.bufused; i++) free(tofree.buf[i]);
     FREE_BUFFER(tofree);
+    FREE_BUFFER(cleaned);
     FREE_BUFFER(cpCmd);
     FREE_BUFFER(installCmd);
 }
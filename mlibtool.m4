@@ -32,6 +32,13 @@ AC_DEFUN([ACX_MLT_INIT], [
             MLIBTOOL="$MLIBTOOL --enable-static"
         fi
 
+        # Probe the target once, rather than in every mlibtool run
+        if $ac_pwd/mlibtool --write-profile="$ac_pwd/mlibtool.profile" \
+           $CC $CFLAGS > /dev/null 2> /dev/null
+        then
+            MLIBTOOL="$MLIBTOOL --profile=$ac_pwd/mlibtool.profile"
+        fi
+
         # And let mlibtool intercede
         LIBTOOL="$MLIBTOOL $LIBTOOL"
     fi